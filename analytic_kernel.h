@@ -0,0 +1,227 @@
+#ifndef ANALYTIC_KERNEL_H
+#define ANALYTIC_KERNEL_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "mpc_kernel.h"
+
+/**
+ * Closed-form evaluation of the jerk candidates. The kernel tests the ego and the prior car
+ * positions at the K steps of the horizon one by one, which costs O(K) per candidate and misses
+ * a fast crossing of the intersection between two steps. With constant accelerations both
+ * positions are quadratics in time, so the times at which a car is in a band of positions (the
+ * obstacle region, the intersection box) are the roots of two quadratics: at most two time
+ * windows per band. The points of a candidate become the time the ego car and the prior car
+ * share a band, in steps of dt (each step stands for [k*dt, (k+1)*dt) of the horizon), 1 per
+ * step in the obstacle region and 10 per step near the intersection as before, and the sum of
+ * the velocity term over the horizon has a closed form as well. A candidate costs the same for
+ * any K and dt, and a crossing shorter than a step is still seen.
+ * The windows of the prior car are computed once per tick, if it brakes to a standstill it
+ * stays in its last band for the rest of the horizon. The decision logic and the cost
+ * weights are the ones of the kernel, only the counting of the points changes, so the chosen
+ * candidate can differ from the Reference mode near the boundaries of the bands.
+ */
+
+// The times in [0, horizon] at which a car is in a band of positions
+struct TimeWindows
+{
+    static const int kMaxWindows = 3;               // A quadratic is in a band at most twice, one more for rounding
+
+    int count = 0;
+    double begin[kMaxWindows], end[kMaxWindows];
+
+    /* Find the times at which pos + vel*t + 0.5*acc*t^2 is strictly between lo and hi.
+    *  \param[in]: pos, vel, acc The motion of the car
+    *  \param[in]: lo, hi The band, either may be infinite
+    *  \param[in]: horizon The end of the time range
+     */
+    void Set(double pos, double vel, double acc, double lo, double hi, double horizon)
+    {
+        // The band boundaries are crossed at the roots, between two of them the car is either in or out
+        double times[6];
+        int num_times = 0;
+        times[num_times++] = 0.0;
+        num_times += Crossings(pos - lo, vel, acc, horizon, &times[num_times]);
+        num_times += Crossings(pos - hi, vel, acc, horizon, &times[num_times]);
+        times[num_times++] = horizon;
+        // Insertion sort, there are at most six times
+        for (int i = 1; i < num_times; i++)
+        {
+            const double t = times[i];
+            int j = i;
+            for (; j > 0 && times[j - 1] > t; j--) {times[j] = times[j - 1];}
+            times[j] = t;
+        }
+        this->count = 0;
+        for (int i = 0; i + 1 < num_times; i++)
+        {
+            if (times[i + 1] <= times[i]) {continue;}
+            const double t = 0.5 * (times[i] + times[i + 1]);
+            const double p = pos + vel * t + 0.5 * acc * t * t;
+            if (!(p > lo && p < hi)) {continue;}
+            if (this->count > 0 && this->end[this->count - 1] == times[i]) {this->end[this->count - 1] = times[i + 1];}
+            else if (this->count < kMaxWindows)
+            {
+                this->begin[this->count] = times[i];
+                this->end[this->count] = times[i + 1];
+                this->count++;
+            }
+        }
+    }
+
+    /* Like Set for a car that stays where it stops if it brakes to a standstill, see HoldAtStop.
+    *  \param[in]: pos, vel, acc The motion of the car
+    *  \param[in]: lo, hi The band, either may be infinite
+    *  \param[in]: horizon The end of the time range
+     */
+    void SetStopping(double pos, double vel, double acc, double lo, double hi, double horizon)
+    {
+        if (acc >= 0.0 || vel + acc * horizon >= 0.0)
+        {
+            Set(pos, vel, acc, lo, hi, horizon);
+            return;
+        }
+        // Quadratic until the stop, then standing at the stop position for the rest of the horizon
+        const double stop_vel = std::max(vel, 0.0);
+        const double t_stop = -stop_vel / acc;
+        const double stop = pos - 0.5 * stop_vel * stop_vel / acc;
+        Set(pos, stop_vel, acc, lo, hi, t_stop);
+        if (!(stop > lo && stop < hi)) {return;}
+        if (this->count > 0 && this->end[this->count - 1] == t_stop) {this->end[this->count - 1] = horizon;}
+        else if (this->count < kMaxWindows)
+        {
+            this->begin[this->count] = t_stop;
+            this->end[this->count] = horizon;
+            this->count++;
+        }
+    }
+
+    // Total time both sets of windows have in common
+    double Overlap(const TimeWindows& other) const
+    {
+        double overlap = 0.0;
+        for (int i = 0; i < this->count; i++)
+        {
+            for (int j = 0; j < other.count; j++)
+            {
+                overlap += std::max(0.0, std::min(this->end[i], other.end[j]) - std::max(this->begin[i], other.begin[j]));
+            }
+        }
+        return overlap;
+    }
+
+private:
+    /* Roots of offset + vel*t + 0.5*acc*t^2 in (0, horizon).
+    *  \param[out]: roots Up to two roots
+    *  \return: The number of roots
+     */
+    static int Crossings(double offset, double vel, double acc, double horizon, double* roots)
+    {
+        if (std::isinf(offset)) {return 0;}
+        double candidates[2];
+        int num_candidates = 0;
+        if (std::abs(acc) < 1e-12)
+        {
+            if (vel != 0.0) {candidates[num_candidates++] = -offset / vel;}
+        }
+        else
+        {
+            const double discriminant = vel * vel - 2.0 * acc * offset;
+            if (discriminant < 0.0) {return 0;}
+            // The numerically stable pair of roots of 0.5*acc*t^2 + vel*t + offset
+            const double q = -(vel + std::copysign(std::sqrt(discriminant), vel));
+            candidates[num_candidates++] = q / acc;
+            if (q != 0.0) {candidates[num_candidates++] = 2.0 * offset / q;}
+        }
+        int num_roots = 0;
+        for (int i = 0; i < num_candidates; i++)
+        {
+            if (candidates[i] > 0.0 && candidates[i] < horizon) {roots[num_roots++] = candidates[i];}
+        }
+        return num_roots;
+    }
+};
+
+class AnalyticKernel {
+
+public:
+    /* Constructor
+    *  \param[in]: params The planner parameters
+     */
+    explicit AnalyticKernel(const MpcParams& params = MpcParams())
+        : params(params)
+    {
+        const int n = (int)params.da_list.size();
+        this->points.assign(n, 0.0);
+        this->cost.assign(n, 0.0);
+        this->valid.assign(n, 0);
+    }
+
+    const MpcParams& Params() const { return this->params; }
+
+    /* Evaluate all jerk candidates with the closed-form windows and select the one with minimum cost.
+    *  \param[in]: ego The current position and velocity of the ego car
+    *  \param[in]: prior The current position, velocity and acceleration of the prior car
+    *  \param[in]: acc_cmd The acceleration command from the previous time step
+    *  \param[in]: yield The YIELD signal of the decision step
+    *  \return: The chosen candidate, the first one if several have the same cost
+     */
+    MpcResult Solve(const EgoState& ego, const PriorCarState& prior, double acc_cmd, bool yield)
+    {
+        const double infinity = std::numeric_limits<double>::infinity();
+        const double dt = this->params.dt;
+        const double K = this->params.K;
+        const double horizon = K * dt;
+        // Sums of k and k^2 over the steps of the horizon, for the velocity term
+        const double sum_k = 0.5 * K * (K - 1);
+        const double sum_k_sq = (K - 1) * K * (2 * K - 1) / 6.0;
+
+        TimeWindows prior_region, prior_near, ego_region, ego_near;
+        prior_region.SetStopping(prior.pos, prior.vel, prior.acc, this->params.yield_line, 0.0, horizon);
+        prior_near.SetStopping(prior.pos, prior.vel, prior.acc, -5.0, 5.0, horizon);
+
+        MpcResult result = { -1, acc_cmd, infinity };
+        for (size_t i = 0; i < this->params.da_list.size(); i++)
+        {
+            const float da = this->params.da_list[i];
+            const double acc = acc_cmd + da;
+            this->valid[i] = (acc <= this->params.max_a && acc >= this->params.min_a);
+            if (!this->valid[i]) {continue;}
+            // Like the kernel, the ego car is predicted with the jerk as its acceleration
+            const double vel0 = ego.vel + da * dt;
+            if (yield) {ego_region.Set(ego.pos, vel0, da, this->params.margin, infinity, horizon);}
+            else {ego_region.Set(ego.pos, vel0, da, -infinity, 0.0, horizon);}
+            ego_near.Set(ego.pos, vel0, da, -5.0, 5.0, horizon);
+            this->points[i] = (ego_region.Overlap(prior_region) + 10.0 * ego_near.Overlap(prior_near)) / dt;
+
+            // sum_k Cv*(vel_target - vel - acc*dt*k)^2 + Ca*acc^2 + points^2
+            const double dv = this->params.vel_target - ego.vel;
+            const double acc_dt = acc * dt;
+            this->cost[i] = this->params.Cv * (K * dv * dv - 2.0 * dv * acc_dt * sum_k + acc_dt * acc_dt * sum_k_sq)
+                            + K * (this->params.Ca * acc * acc + this->points[i] * this->points[i]);
+            if (result.index < 0 || this->cost[i] < result.cost)
+            {
+                result.index = (int)i;
+                result.acc = acc;
+                result.cost = this->cost[i];
+            }
+        }
+        return result;
+    }
+
+    // Cost of candidate i after the last Solve, infinity if it violated the acceleration limits
+    double Cost(int i) const { return this->valid[i] ? this->cost[i] : std::numeric_limits<double>::infinity(); }
+
+    // Points of candidate i after the last Solve, the shared time in steps
+    double Points(int i) const { return this->points[i]; }
+
+private:
+    const MpcParams params;
+    std::vector<double> points;                     // Points in the obstacle region of every candidate
+    std::vector<double> cost;                       // Cost of every candidate
+    std::vector<char> valid;                        // If the candidate respects max_a and min_a
+};
+
+#endif // ANALYTIC_KERNEL_H
@@ -2,18 +2,51 @@
 #include <gazebo/transport/transport.hh>
 #include <gazebo/msgs/msgs.hh>
 #include <ignition/math/Rand.hh>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
-#include "build/custom_messages.pb.h"
+#include "custom_messages.pb.h"
+#include "event_log.h"
+#include "latency_trace.h"
+#include "mailbox.h"
+#include "planner.h"
+#include "record_log.h"
+#include "slab.h"
+#include "thread_pool.h"
 
 #include <gazebo/gazebo_client.hh>
-#define verbose false //If true, then print out all debug msgs
-#define ApplyEBrake false   //If true, apply emergency brake to strictly follow right hand rule
-using namespace std; 
+using namespace std;
 /**
  * Minimal client application to connect to the simulator, receive the
  * current world state and send the next ego vehicle velocity.
- * You need to extend the OnWorldStateReceived function, the rest
+ * The planning itself is done by the Planner (planner.h), the rest
  * is the boilerplate code for communication.
+ * Receiving, planning and publishing are separate stages connected by latest-wins
+ * mailboxes (mailbox.h): the subscriber callback only copies the world state, a planning
+ * thread plans on the newest one and a publishing thread sends the newest command.
+ * One process can host many controllers, each bound to the topics of its own Gazebo world
+ * (~/world_state, ~/statistics and ~/client_command in that world). Then the planning of all
+ * controllers runs as tasks on one thread pool sized to the cores: a received world state
+ * schedules a task for its controller unless one is pending, and the task plans on the newest
+ * state and publishes the command right away. The controllers live in a cache-line-aligned slab
+ * (slab.h), and the fields written by the transport and by the planning side of a controller
+ * are on separate cache lines.
+ * Diagnostics go to the asynchronous event log (event_log.h) when it is enabled with --log,
+ * the planning threads only queue binary records and never wait for the file.
+ *
+ * Usage: client_controller [--controllers N] [--world-prefix PREFIX] [--worlds W1,W2,...]
+ *                          [--threads N] [--record FILE] [--log FILE]
+ *                          [--log-level debug|info|warn|error]
+ * Without --controllers or --worlds a single controller with its own threads serves the
+ * default world. --controllers N serves the worlds PREFIX0 ... PREFIX(N-1), --record FILE then
+ * writes one log per controller, FILE.<world>. The event log of all controllers is one file,
+ * its lines carry the world; the level defaults to info, debug logs every world state and
+ * command.
  */
 
 typedef const boost::shared_ptr<
@@ -28,29 +61,30 @@ class Controller {
 
 public:
     /* Constructor
-    *  Initialize the vectors priorcar_predicted_pos and egocar_predicted_pos with size of K
-    *  Initialize priorcar_pos, priorcar_vel, priorcar_acc, acc_cmd and da_cmd
+    *  Initialize the episode, success and collision counters
+    *  \param[in]: index Number of the controller in the host process
+    *  \param[in]: worlds The Gazebo world of every controller, an empty name is the default world
+    *  \param[in]: pool The pool planning for all controllers, not owned, null for dedicated threads
     */
-    Controller() 
+    Controller(size_t index, const std::vector<std::string>& worlds, ThreadPool* pool)
+        : index((int32_t)index), world(worlds[index]), pool(pool)
     {
-        this->priorcar_predicted_pos.resize(this->K);
-        this->egocar_predicted_pos.resize(this->K);
-        this->priorcar_pos = 50.0;
-        this->priorcar_vel = 0.0;
-        this->priorcar_acc = 0.0;
-        this->acc_cmd = 0.0;
-        this->da_cmd = 0.0;
         this->episode = 0;
         this->success = 0;
         this->collision = 0;
-        this->points_in_region = 0;
+    }
+
+    ~Controller()
+    {
+        // A planning task may still be queued on the shared pool
+        while (this->scheduled.load()) {std::this_thread::yield();}
     }
 
     void Init()
     {
-        // Create our node for communication
+        // Create our node for communication, the ~ of the topic names is the namespace of the world
         node = gazebo::transport::NodePtr(new gazebo::transport::Node());
-        node->Init();
+        node->Init(this->world);
 
         // Subscribe to the topic, and register a callback
         this->world_sub = node->Subscribe(worldTopicName, &Controller::OnWorldStateReceived, this);
@@ -67,37 +101,33 @@ public:
     // Called when the simulator resets the world after reaching the goal, running out of time or crashing
     void ResetWorld()
     {
-        std::cout << "New simulation round started, resetting world." << std::endl;
+        std::cout << Prefix() << "New simulation round started, resetting world." << std::endl;
         this->episode += 1;
+        this->planner.Reset();
+        LOG_EVENT(Info, RoundStart, this->simulation_round, this->episode.load());
     }
 
-    void PrintWorldStateMessage(WorldStateRequestPtr& msg) const
+    // Log the world state and the cars of lane 1 at the debug level
+    void LogWorldState(const custom_messages::WorldState& msg) const
     {
-        if(verbose)
-        {
-        std::cout << "Simulation round: " << msg->simulation_round() << "; "
-                  << "time: " << msg->time().sec() << "." << msg->time().nsec() << std::endl;
-        std::cout << "  ego_car p: (" << msg->ego_vehicle().position().x() << ", " << msg->ego_vehicle().position().y()
-                  << ") v: (" << msg->ego_vehicle().velocity().x() << ", " << msg->ego_vehicle().velocity().y() << "); " << std::endl;
-        for (const auto& vehicle_msg : msg->vehicles())
+        if (!EventLog::Instance().Enabled(LogLevel::Debug)) {return;}
+        LOG_EVENT(Debug, WorldState, msg.simulation_round(), msg.time().sec() + 1e-9 * msg.time().nsec(),
+                  msg.ego_vehicle().position().x(), msg.ego_vehicle().position().y(),
+                  msg.ego_vehicle().velocity().x(), msg.ego_vehicle().velocity().y());
+        for (const auto& vehicle_msg : msg.vehicles())
         {
             if(vehicle_msg.lane_id() == 1)
             {
-            std::cout << "  car id " << vehicle_msg.vehicle_id()
-                      << " lane id: " << vehicle_msg.lane_id()
-                      << " p: (" << vehicle_msg.position().x() << ", " << vehicle_msg.position().y()
-                      << ") v: (" << vehicle_msg.velocity().x() << ", " << vehicle_msg.velocity().y() << "); "
-                      << std::endl;
+                LOG_EVENT(Debug, Vehicle, vehicle_msg.vehicle_id(), vehicle_msg.lane_id(),
+                          vehicle_msg.position().x(), vehicle_msg.position().y(),
+                          vehicle_msg.velocity().x(), vehicle_msg.velocity().y());
             }
         }
-
-        std::cout << std::endl;
-        }
     }
 
     void PrintStatisticsMessage(StatisticsRequestPtr& msg) const
     {
-        std::cout << "Statistics from previous round: "<<endl
+        std::cout << Prefix() << "Statistics from previous round: "<<endl
                   << "Success: " << msg->success() <<endl
                   << "collision: " << msg->collision_detected() <<endl
                   << "Time steps: "
@@ -107,281 +137,151 @@ public:
                   << "Success rate is "<<this->success + 1<<"/"<<this->episode<<endl;
     }
 
-    // Called every time a new update is received from the simulator.
-    // This is the main function where you should implement your code
-    void OnWorldStateReceived(WorldStateRequestPtr& msg)
+    /* Record all received world states and statistics and all planned commands, call before Init.
+    *  \return: false if the log file cannot be created
+     */
+    bool Record(const std::string& path)
     {
-        PrintWorldStateMessage(msg);
+        return this->recorder.Open(path);
+    }
 
-        // If the simulation round is different then this is a whole new setting, reinitialize the world
-        if (msg->simulation_round() != simulation_round)
-        {
-            ResetWorld();
-            simulation_round = msg->simulation_round();
-            this->priorcar_pos = 50.0;
-        }
+    /* Start the planning and the publishing stage, call after Init. With a shared pool the
+    *  planning tasks are scheduled by the received world states instead.
+     */
+    void Start()
+    {
+        if (this->pool) {return;}
+        this->planning_thread = std::thread(&Controller::PlanningLoop, this);
+        this->publishing_thread = std::thread(&Controller::PublishingLoop, this);
+    }
+
+    // Stop both stages, the world states and commands still in the mailboxes are dropped
+    void Stop()
+    {
+        this->world_states.Close();
+        this->commands.Close();
+        if (this->planning_thread.joinable()) {this->planning_thread.join();}
+        if (this->publishing_thread.joinable()) {this->publishing_thread.join();}
+        this->recorder.Close();
+        std::cout << Prefix() << "World states overwritten before planning: " << this->dropped_states
+                  << ", stale world states and commands discarded: " << this->stale << std::endl;
+    }
 
-        // Calculate the next velocity for the ego car and send the response.
-        // Implement your code here
-        SetPriorCar(msg);
-        // Print the state and commands if needed.
-        if(verbose)
+    // Called every time a new update is received from the simulator.
+    // It only copies the world state into the mailbox of the planning stage, so the transport is never blocked by planning
+    void OnWorldStateReceived(WorldStateRequestPtr& msg)
+    {
+        TRACE_BIND(&this->trace);
+        TRACE_SCOPE(Parse);
+        const uint64_t sequence = ++this->received_states;
+        if (this->recorder.IsOpen()) {this->recorder.Write(RecordType::WorldState, sequence, *msg);}
+        this->latest_round.store(msg->simulation_round(), std::memory_order_relaxed);
+        ReceivedState& state = this->world_states.Slot();
+        state.msg.CopyFrom(*msg);
+        state.sequence = sequence;
+        if (this->world_states.Put()) {this->dropped_states++;}
+        // Schedule a planning task unless one is pending, it will take this world state
+        if (this->pool && !this->scheduled.exchange(true))
         {
-            cout<< "Prior car is at "<< this->priorcar_pos<<" with speed "
-            <<this->priorcar_vel<<", acceleration is "<<this->priorcar_acc<<endl;  
-            cout<<"Ego car is at "<<msg->ego_vehicle().position().x()<<" with speed "<<msg->ego_vehicle().velocity().x()<<endl;
+            this->pool->Submit([this]() {PlanPending();});
         }
-        // Make action decision according to ego car position and prior car states, either yield or surpass the prior car.
-        MakeDecision(msg);
-        // Predict ego car's future acceleration list.
-        PredictEgocarAcc(msg);
-        // Calculate the cost according to the acceleration list
-        CalculateCost(msg);
-        // Set velocity according to the cost list
-        SetVel(msg);
-        custom_messages::Command response_msg;
-        response_msg.set_ego_car_speed(this->vel_cmd);
-        response_msg.set_simulation_round(msg->simulation_round());
-        this->pub->Publish(response_msg);
     }
 
     void OnStatisticsReceived(StatisticsRequestPtr& msg)
     {
+        if (this->recorder.IsOpen()) {this->recorder.Write(RecordType::Statistics, this->received_states, *msg);}
+        EventLog::SetSource(this->index);
+        LOG_EVENT(Info, Statistics, msg->success(), msg->collision_detected(), msg->simulation_time_steps_taken(),
+                  msg->total_acceleration(), msg->limits_respected());
         PrintStatisticsMessage(msg);
         if(msg->success() == 1){this->success += 1;}
         if(msg->collision_detected() == 1){this->collision += 1;}
     }
 
-private:
+    // The world of the controller, empty for the default world
+    const std::string& World() const { return this->world; }
 
-    // Reset all the lists of prior cars
-    void ResetPriorCarList()
+private:
+    // A received world state with its number, for matching it with its command in the record log
+    struct ReceivedState
     {
-        this->priorcar_yield_pos_list.clear();
-        this->priorcar_yield_vel_list.clear();
-        this->priorcar_surpass_pos_list.clear();
-        this->priorcar_surpass_vel_list.clear();
-    }
+        custom_messages::WorldState msg;
+        uint64_t sequence;
+    };
 
-    /* Set the prior car position and velocity according all the received car states
-    *  First check if there are cars on the right of the ego car, if so then categorize them 
-    *  in priorcar_yield_pos_list and priorcar_surpass_pos_list according to yield_line.
-    *  The first car in the priorcar_surpass_pos_list is the prior car but can be surpassed.
-    *  The last car in the priorcar_yield_pos_list is the prior car but need to be yielded.
-    *  If both priorcar_yield_pos_list and priorcar_surpass_pos_list have cars, then check
-    *  the distance between the last car of priorcar_yield_pos_list and the first car of
-    *  priorcar_surpass_pos_list, if distance is less than yield_line, then make the car in
-    *  priorcar_surpass_pos_list the prior car.
-    *  \param[in/out]: priorcar_pos
-    *                  priorcar_vel
-    *                  priorcar_acc
-    *  \param[in]: WorldStateRequestPtr The states of all other cars
-    *  \param[in]: yield_line The threshold for categorizing prior cars
-     */ 
-    void SetPriorCar(WorldStateRequestPtr& msg)
-    {
-        // Reset all the lists
-        ResetPriorCarList();    
-        // Read states of all cars
-        for (const auto& vehicle_msg : msg->vehicles())
-        {  
-            // If cars show up on lane 1 and on the right,
-            if (vehicle_msg.lane_id() == 1 && vehicle_msg.position().y() < 0)
-            {
-                // then catagorize them according to yield_line.
-                if (vehicle_msg.position().y() > this->yield_line)
-                {
-                    this->priorcar_yield_pos_list.push_back(vehicle_msg.position().y());
-                    this->priorcar_yield_vel_list.push_back(vehicle_msg.velocity().y());
-                }
-                else
-                {
-                    this->priorcar_surpass_pos_list.push_back(vehicle_msg.position().y());
-                    this->priorcar_surpass_vel_list.push_back(vehicle_msg.velocity().y());
-                }
-            }  
-        }
-        // If there is any prior car on the right side
-        if (this->priorcar_yield_pos_list.size() > 0 || this->priorcar_surpass_pos_list.size() > 0)
-        {
-            //If both priorcar_yield_pos_list and priorcar_surpass_pos_list have cars
-            if(this->priorcar_yield_pos_list.size() > 0 && this->priorcar_surpass_pos_list.size() > 0)
-            {   
-            /*Check the distance between the last car of priorcar_yield_pos_list and the first car of
-            *  priorcar_surpass_pos_list, if distance is less than yield_line, then make the car in
-            *  priorcar_surpass_pos_list the prior car.
-            */
-                int priorCarYieldIndex = min_element(this->priorcar_yield_pos_list.begin(),this->priorcar_yield_pos_list.end()) - this->priorcar_yield_pos_list.begin();
-                int priorCarSurpassIndex = max_element(this->priorcar_surpass_pos_list.begin(),this->priorcar_surpass_pos_list.end()) - this->priorcar_surpass_pos_list.begin();
-                if(this->priorcar_surpass_pos_list[priorCarSurpassIndex] - this->priorcar_yield_pos_list[priorCarYieldIndex] > this->yield_line)
-                {
-                    this->priorcar_pos = this->priorcar_surpass_pos_list[priorCarSurpassIndex];
-                    this->priorcar_vel = this->priorcar_surpass_vel_list[priorCarSurpassIndex];
-                }
-                else
-                {
-                    this->priorcar_pos = this->priorcar_yield_pos_list[priorCarYieldIndex];
-                    this->priorcar_vel = this->priorcar_yield_vel_list[priorCarYieldIndex];
-                }
-            }
-            //If only priorcar_yield_pos_listst has cars, then the last car is the prior car.
-            else if(this->priorcar_yield_pos_list.size() > 0 && this->priorcar_surpass_pos_list.size() == 0)
-            {
-                int priorCarYieldIndex = min_element(this->priorcar_yield_pos_list.begin(),this->priorcar_yield_pos_list.end()) - this->priorcar_yield_pos_list.begin();
-                this->priorcar_pos = this->priorcar_yield_pos_list[priorCarYieldIndex];
-                this->priorcar_vel = this->priorcar_yield_vel_list[priorCarYieldIndex];
-            }
-            //If only priorcar_surpass_pos_list has cars, then the first car is the prior car.
-            else
-            {
-                int priorCarSurpassIndex = max_element(this->priorcar_surpass_pos_list.begin(),this->priorcar_surpass_pos_list.end()) - this->priorcar_surpass_pos_list.begin();
-                this->priorcar_pos = this->priorcar_surpass_pos_list[priorCarSurpassIndex];
-                this->priorcar_vel = this->priorcar_surpass_vel_list[priorCarSurpassIndex];
-            }
-        }
-        //If no cars on the right, then reinitialize priorcar_pos, priorcar_vel and priorcar_acc
-        else
-        {
-            this->priorcar_pos = 50.0;
-            this->priorcar_vel = this->max_v;
-            this->priorcar_acc = 0.0;
-        }
-    }
+    // Tells the controllers of a host process apart in the output
+    std::string Prefix() const { return this->world.empty() ? std::string() : "[" + this->world + "] "; }
 
-    /* Make action decision according to ego car position and prior car states, either yield or surpass the prior car.
-    *  \param[in/out]: YIELD
-    *  \param[in]: WorldStateRequestPtr The position of the ego car
-    *  \param[in]: yield_line
-    *  \param[in]: priorcar_pos
-     */
-    void MakeDecision(WorldStateRequestPtr& msg)
-    {
-        this->YIELD  = false;
-        //If the prior car crosses the yield_line, then apply yield action.
-        if(this->priorcar_pos > this->yield_line && msg->ego_vehicle().position().x() < 0){this->YIELD  = true; if(verbose){cout<<"Yield!"<<endl;}}
-        //Backup line if(this->priorcar_pos > this->yield_line && msg->ego_vehicle().position().x() < margin){this->YIELD  = true; if(verbose({cout<<"Yield!"<<endl;}}
-    }
- 
-    /* Predict a car's future positions with constant acceleration in K steps.
-    *  \param[in/out]: vector predicted_pos
-    *  \param[in]: current_pos - The current position of the car.
-    *  \param[in]: current_vel - The current velocity of the car.
-    *  \param[in]: current_acc - The current acceleration of the car.
+    /* Plan on a received world state.
+    *  \param[out]: response_msg The command for the ego car
+    *  \return: false if the world state is stale and there is no command
      */
-    void PredictPosWithConstAcc(vector<double>& predicted_pos, const double current_pos, const double current_vel, const double current_acc)
+    bool PlanState(const ReceivedState& state, custom_messages::Command& response_msg)
     {
-        for (int k = 0; k < this->K; k++)
+        const custom_messages::WorldState* msg = &state.msg;
+        // A world state of an older round than the latest received one is stale
+        if (msg->simulation_round() != this->latest_round.load(std::memory_order_relaxed)) {this->stale++; return false;}
+        TRACE_SCOPE(Tick);
+        // A pool thread plans for many controllers, the records it logs from here on belong to this one
+        EventLog::SetSource(this->index);
+        LogWorldState(*msg);
+
+        // If the simulation round is different then this is a whole new setting, reinitialize the world
+        if (msg->simulation_round() != simulation_round)
         {
-            // Formula : Xt+dt = Xt + Vt * dt + 1/2 * At * dt^2
-            predicted_pos[k] = current_pos + current_vel*k*this->dt + 0.5*current_acc*pow(k*this->dt,2);
+            simulation_round = msg->simulation_round();
+            ResetWorld();
+            TRACE_BEGIN_ROUND(simulation_round);
         }
+
+        // Calculate the next velocity for the ego car
+        response_msg.set_ego_car_speed(this->planner.Plan(*msg));
+        response_msg.set_simulation_round(msg->simulation_round());
+        if (this->recorder.IsOpen()) {this->recorder.Write(RecordType::Command, state.sequence, response_msg);}
+        return true;
     }
 
-    /* Predict ego car's future acceleration list according to the ego car's current and predicted positions,
-    *  prior car predicted positions and YIELD signal. 
-    *  \param[in/out]: vector acc_list
-    *  \param[in]: ego_vehicle().position().x() - The current position of ego car.
-    *  \param[in]: egocar_predicted_pos - The predicted positions of the ego car.
-    *  \param[in]: priorcar_predicted_pos - The predicted positions of the prior car.
-    *  \param[in]: acc_cmd - acceleration command from previous time step.
-    */
-    void PredictEgocarAcc(WorldStateRequestPtr& msg)
+    // Planning stage, plans on the latest world state and hands the command to the publishing stage
+    void PlanningLoop()
     {
-        // Predict the future positions of the prior car
-        PredictPosWithConstAcc(this->priorcar_predicted_pos, this->priorcar_pos, this->priorcar_vel, this->priorcar_acc);
-        // Initialize acc_list 
-        this->acc_list.clear();
-        this->point_in_region_list.clear();
-        // Add each element of da_list to previous acc_cmd
-        for(vector<float>::const_iterator it = this->da_list.begin(); it != this->da_list.end(); ++it)
-        {   
-            this->points_in_region = 0;
-            // Limit acc_cmd with max_a and min_a
-            if (this->acc_cmd + *it <= this->max_a && this->acc_cmd + *it >= this->min_a)
-            {
-                // Only take consideration of YIELD signal when the ego car hasnt passed the intersection
-                // Calculate the next velocity
-                double ego_vel_temp = msg->ego_vehicle().velocity().x() + (*it) * this->dt;
-
-                // Predict the future positions of the ego car with this acc_cmd
-                PredictPosWithConstAcc(this->egocar_predicted_pos, msg->ego_vehicle().position().x(), ego_vel_temp, *it);
-                for (int k = this->K - 1; k >= 0; k--)
-                {
-                    //If the position at k point is in the obstacle region, penalize it.
-                    //If ego car needs to yield, it should wait for the prior car to pass.
-                    if(this->YIELD)
-                    {                            
-                        if(this->egocar_predicted_pos[k] > margin && this->priorcar_predicted_pos[k] < 0 && this->priorcar_predicted_pos[k] > this->yield_line)
-                        {this->points_in_region += 1;}
-                    }
-                    //If ego car can surpass, it should pass as soon as possbile before prior car crosses yield line.
-                    else 
-                    {
-                        if(this->egocar_predicted_pos[k] < 0 && this->priorcar_predicted_pos[k] < 0 && this->priorcar_predicted_pos[k] > this->yield_line)
-                        {this->points_in_region += 1;}
-                    }
-                    //If there is collision risk, penalize it with 10 points.
-                    if(abs(this->egocar_predicted_pos[k]) < 5 && abs(this->priorcar_predicted_pos[k]) < 5)
-                    {this->points_in_region += 10;}
-                }  
-                this->acc_list.push_back(*it + this->acc_cmd);
-                this->point_in_region_list.push_back(this->points_in_region);
-            }
+        TRACE_BIND(&this->trace);
+        // The command messages of the mailbox are reused
+        while (const ReceivedState* state = this->world_states.WaitTake())
+        {
+            if (PlanState(*state, this->commands.Slot())) {this->commands.Put();}
         }
     }
 
-    /* Calculate the costs and store the calculated cost according to valid acc_cmds.
-    *  Formula : Cv(vel_target - vel_next)^2 + Ca(acc^2) + (number of points that in the obstacle region)^2
-    *  \param[in/out]: vector cost_list
-    *  \param[in]: vel_target - The target velocity of ego car.
-    *  \param[in]: vel_next - The next possible velocity of ego car.
-    *  \param[in]: acc_list - The valid accelerations.
-     */
-    void CalculateCost(WorldStateRequestPtr& msg)
+    // Planning task on the shared pool, plans on the latest world state and publishes the command right away
+    void PlanPending()
     {
-        // Initialize cost_list
-        this->cost_list.clear();
-        // Loop over each valid acceleration in K steps and store the calculated cost in cost_list
-        for(int i = 0; i < this->acc_list.size(); i++)
+        // A pool thread plans for many controllers, its probes record into the trace of this one
+        TRACE_BIND(&this->trace);
+        do
         {
-            // Initialize a temp cost value
-            double cost_temp = 0;
-            for(int k = 0; k < this->K; k++)
+            while (const ReceivedState* state = this->world_states.Take())
             {
-                double vel_temp = msg->ego_vehicle().velocity().x() + this->acc_list[i] * this->dt * k;
-                cost_temp += this->Cv*pow(this->vel_target - vel_temp, 2) + Ca*pow(this->acc_list[i], 2) + pow(this->point_in_region_list[i], 2);
+                if (!PlanState(*state, this->response)) {continue;}
+                TRACE_SCOPE(Publish);
+                this->pub->Publish(this->response);
             }
-            this->cost_list.push_back(cost_temp);
-            
-        }
+            this->scheduled.store(false);
+            // A world state put after the last Take saw the task still scheduled and did not schedule another one
+        } while (this->world_states.HasNew() && !this->scheduled.exchange(true));
     }
 
-    /* Set the velocity according to the minimum cost while keep acc_cmd and vel_cmd under constraints.
-    *  \param[in/out]: acc_cmd
-    *  \param[in/out]: vel_cmd
-    *  \param[in]: vector cost_list
-    *  \param[in]: vector acc_list
-     */
-    void SetVel(WorldStateRequestPtr& msg)
+    // Publishing stage, sends the latest command unless a new round started in the meantime
+    void PublishingLoop()
     {
-        //Set the acceleration that has the minimum cost and keep it in constraints
-
-        int minCostIndex = min_element(this->cost_list.begin(),this->cost_list.end()) - this->cost_list.begin();
-        this->da_cmd = this->acc_list[minCostIndex] - this->acc_cmd;
-        this->acc_cmd = this->acc_list[minCostIndex];
-        if (this->acc_cmd > this->max_a){this->acc_cmd = this->max_a;}
-        if (this->acc_cmd < this->min_a){this->acc_cmd = this->min_a;}
-
-        //Set the velocity according to the selected acceleration and keep it in constraints
-        this->vel_cmd = msg->ego_vehicle().velocity().x() + this->acc_cmd * this->dt;
-        if (this->vel_cmd > this->max_v){this->vel_cmd = this->max_v; this->acc_cmd = 0.0;}
-        if (this->vel_cmd < this->min_v){this->vel_cmd = this->min_v; this->acc_cmd = 0.0;}  
-        if (ApplyEBrake && msg->ego_vehicle().position().x() > this->margin && this->priorcar_pos < 0 && msg->ego_vehicle().position().x() < 0 && this->priorcar_pos > this->margin)
-        {this->vel_cmd = 0.0; this->acc_cmd = 0.0; if(verbose){cout<<"In Margin!"<<endl;}}     
-        if(verbose){cout<<"Velocity command is "<<this->vel_cmd<<" with acceleration of "<<this->acc_cmd<<" ,jerk is "<<this->da_cmd<<endl;}
+        TRACE_BIND(&this->trace);
+        while (const custom_messages::Command* response_msg = this->commands.WaitTake())
+        {
+            if (response_msg->simulation_round() != this->latest_round.load(std::memory_order_relaxed)) {this->stale++; continue;}
+            TRACE_SCOPE(Publish);
+            this->pub->Publish(*response_msg);
+        }
     }
 
-private:
     gazebo::transport::NodePtr node;
     gazebo::transport::SubscriberPtr world_sub;
     gazebo::transport::SubscriberPtr statistics_sub;
@@ -390,50 +290,132 @@ private:
     std::string worldTopicName = "~/world_state";
     std::string statisticsTopicName = "~/statistics";
     std::string commandTopicName = "~/client_command";
-
-    int32_t simulation_round = 0;
-    double priorcar_pos;                            // Define the position of the prior car
-    double priorcar_vel;                            // Define the velocity of the prior car
-    double priorcar_acc;                            // Define the acceleration of the prior car, here is always 0
-    double vel_cmd;                                 // The velocity command sent to the ego car
-    double acc_cmd;                                 // The acceleration command for deciding next vel_cmd
-    double da_cmd;                                  // Jerk of every acceleration command
-    const int K = 50;                               // Number of steps for prediction horizon
-    const double Cv = 1.0;                          // Factor for velocity term in cost function
-    const double Ca = 2.0;                          // Factor for acceleration term in cost function
-    const double margin = -10.0;                    // Margin as the safety distance before the intersection
-    const double vel_target = 20.0;                 // Take max velocity as the target velocity
-    const double max_a = 1.99, min_a = -1.99, max_v = 20.0, min_v = 0.0; // Acceleration and velocity constraints setup
-    const vector<float> da_list = { -0.19, -0.1, 0.0, 0.1, 0.19 };   // Jerk constraints setup
-    const float dt = 0.1;                           // Time step in seconds
-    const double yield_line = -20;                  // In the yield line ego car should defer to the prior car 
-    bool YIELD;                                     // A signal indicating if the ego car should yield
-    vector<double> priorcar_predicted_pos;          // A vector for storing predicted positions of the prior car in K steps
-    vector<double> egocar_predicted_pos;            // A vector for storing predicted positions of the ego car in K steps
-    vector<double> acc_list;                        // Acceleration candidates for calculating cost function
-    vector<int> point_in_region_list;               // Point list that stored how many points are in the obstacle region
-    vector<double> cost_list;                       // Calculated costs according to acceleration candidates
-    vector<double> priorcar_surpass_pos_list;       // The list of positions of prior cars that can be surpassed
-    vector<double> priorcar_yield_pos_list;         // The list of positions of prior cars that need to be yielded
-    vector<double> priorcar_surpass_vel_list;       // The list of velocities of prior cars that can be surpassed
-    vector<double> priorcar_yield_vel_list;         // The list of velocities of prior cars that need to be yielded
-    int episode;                                    // Counting the simulation episode
-    int success;                                    // Counting the number of success
-    int collision;                                  // Counting the number of collision
-    int points_in_region;                           // Number of points that are in the obstacle region for each acceleration
+    const int32_t index;                            // Number of the controller in the host process, its source in the event log
+    const std::string world;                        // Gazebo world whose topics the controller is bound to
+    ThreadPool* const pool;                         // Shared pool of the host process, null for dedicated threads
+
+    // Written by the planning side
+    alignas(kCacheLine) int32_t simulation_round = 0; // Round of the planner, only used by the planning stage
+    Planner planner;                                // The MPC planner of the ego car
+#if PLANNER_TRACE
+    LatencyTrace trace;                             // Latencies of the stages of this controller, its own rounds
+#endif
+    custom_messages::Command response;              // Command of the pooled planning task, reused
+    std::atomic<long> stale{0};                     // World states and commands of an outdated round
+
+    // Written by the transport thread on every world state
+    alignas(kCacheLine) std::atomic<int32_t> latest_round{0}; // Round of the latest received world state
+    std::atomic<uint64_t> received_states{0};       // Number of world states received so far
+    std::atomic<long> dropped_states{0};            // World states overwritten by a newer one before planning
+    std::atomic<bool> scheduled{false};             // If a planning task is queued or running on the pool
+
+    LatestMailbox<ReceivedState> world_states;      // Received world states for the planning stage
+    LatestMailbox<custom_messages::Command> commands; // Planned commands for the publishing stage
+    std::thread planning_thread;
+    std::thread publishing_thread;
+    RecordWriter recorder;                          // Record log of all messages, if enabled
+    std::atomic<int> episode;                       // Counting the simulation episode
+    std::atomic<int> success;                       // Counting the number of success
+    std::atomic<int> collision;                     // Counting the number of collision
 };
 
+// Set by SIGUSR1 to dump the latency histograms, and by SIGINT/SIGTERM to shut down
+static volatile sig_atomic_t dump_requested = 0;
+static volatile sig_atomic_t shutdown_requested = 0;
+
+static void OnDumpSignal(int) { dump_requested = 1; }
+static void OnShutdownSignal(int) { shutdown_requested = 1; }
+
 int main(int _argc, char **_argv)
 {
     // Load gazebo as a client
     gazebo::client::setup(_argc, _argv);
 
-    Controller controller;
-    controller.Init();
+    std::vector<std::string> worlds;
+    int num_controllers = 0;
+    std::string world_prefix = "world_";
+    unsigned num_threads = std::thread::hardware_concurrency();
+    std::string record_path;
+    std::string log_path;
+    LogLevel log_level = LogLevel::Info;
+    for (int i = 1; i < _argc; i++)
+    {
+        const char* arg = _argv[i];
+        const char* value = (i + 1 < _argc) ? _argv[i + 1] : nullptr;
+        if (value == nullptr) {break;}
+        if (!strcmp(arg, "--controllers")) {num_controllers = std::max(1, atoi(value));}
+        else if (!strcmp(arg, "--world-prefix")) {world_prefix = value;}
+        else if (!strcmp(arg, "--threads")) {num_threads = (unsigned)std::max(1, atoi(value));}
+        else if (!strcmp(arg, "--record")) {record_path = value;}
+        else if (!strcmp(arg, "--log")) {log_path = value;}
+        else if (!strcmp(arg, "--log-level"))
+        {
+            if (!ParseLogLevel(value, log_level)) {std::cerr << "Unknown log level " << value << std::endl; return 1;}
+        }
+        else if (!strcmp(arg, "--worlds"))
+        {
+            for (const char* begin = value; *begin;)
+            {
+                const char* end = std::strchr(begin, ',');
+                if (end == nullptr) {end = begin + std::strlen(begin);}
+                if (end > begin) {worlds.emplace_back(begin, end);}
+                begin = (*end == ',') ? end + 1 : end;
+            }
+        }
+        // Leave the arguments of Gazebo alone
+        else {continue;}
+        i++;
+    }
+    for (int c = 0; c < num_controllers; c++) {worlds.push_back(world_prefix + std::to_string(c));}
+    // A single controller of the default world keeps its own planning and publishing threads
+    const bool host = !worlds.empty();
+    if (!host) {worlds.push_back(std::string());}
+
+    // The pool is declared first, so it outlives the controllers that queue tasks on it
+    std::unique_ptr<ThreadPool> pool(host ? new ThreadPool(num_threads) : nullptr);
+    Slab<Controller> controllers(worlds.size(), worlds, pool.get());
+    for (size_t c = 0; c < controllers.Size(); c++)
+    {
+        // client_controller --record <file> logs all messages for the replay tool
+        const std::string path = host ? record_path + "." + controllers[c].World() : record_path;
+        if (!record_path.empty() && !controllers[c].Record(path))
+        {
+            std::cerr << "Cannot create the record log " << path << std::endl;
+            return 1;
+        }
+    }
+    for (size_t c = 0; c < controllers.Size(); c++) {EventLog::Instance().NameSource((int32_t)c, controllers[c].World());}
+    if (!log_path.empty() && !EventLog::Instance().Open(log_path, log_level))
+    {
+        std::cerr << "Cannot create the event log " << log_path << std::endl;
+        return 1;
+    }
+    for (size_t c = 0; c < controllers.Size(); c++) {controllers[c].Init();}
+    for (size_t c = 0; c < controllers.Size(); c++) {controllers[c].Start();}
+    if (host) {std::cout << "Serving " << controllers.Size() << " worlds on " << pool->Size() << " threads" << std::endl;}
+
+    // kill -USR1 <pid> prints the per-stage latencies of the planner
+    std::signal(SIGUSR1, OnDumpSignal);
+    std::signal(SIGINT, OnShutdownSignal);
+    std::signal(SIGTERM, OnShutdownSignal);
 
     // for (int i = 0; i < 100; ++i)
-    while (true)
+    while (!shutdown_requested)
+    {
         gazebo::common::Time::MSleep(100);
+        if (dump_requested)
+        {
+            dump_requested = 0;
+            TRACE_DUMP(std::cout);
+        }
+    }
+    for (size_t c = 0; c < controllers.Size(); c++) {controllers[c].Stop();}
+    TRACE_DUMP(std::cout);
+    if (!log_path.empty())
+    {
+        std::cout << "Event log records dropped: " << EventLog::Instance().Dropped() << std::endl;
+        EventLog::Instance().Close();
+    }
 
     // Make sure to shut everything down.
     gazebo::client::shutdown();
@@ -0,0 +1,114 @@
+#ifndef EPISODE_H
+#define EPISODE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "custom_messages.pb.h"
+#include "event_log.h"
+#include "latency_trace.h"
+#include "planner.h"
+#include "record_log.h"
+#include "world_sim.h"
+
+/**
+ * Running the planner through whole episodes of the in-process world (world_sim.h), shared by
+ * the headless simulation harness and the parameter tuner.
+ */
+
+// Number of world states written to record logs so far, numbers the world state records
+inline std::atomic<uint64_t>& RecordedStates()
+{
+    static std::atomic<uint64_t> recorded_states(0);
+    return recorded_states;
+}
+
+// Statistics accumulated over episodes, the same metrics as custom_messages::Statistics
+struct EpisodeTotals
+{
+    long episodes = 0;
+    long success = 0;
+    long collision = 0;
+    long limits_violated = 0;
+    long timeout = 0;
+    long time_steps = 0;                            // Time steps of all episodes
+    long success_time_steps = 0;                    // Time steps of the successful episodes
+    double total_acceleration = 0.0;
+    long mismatches = 0;                            // Commands that differ from the reference planner
+
+    void Add(const custom_messages::Statistics& stats)
+    {
+        this->episodes += 1;
+        if (stats.success()) {this->success += 1; this->success_time_steps += stats.simulation_time_steps_taken();}
+        if (stats.collision_detected()) {this->collision += 1;}
+        if (!stats.limits_respected()) {this->limits_violated += 1;}
+        if (!stats.success() && !stats.collision_detected()) {this->timeout += 1;}
+        this->time_steps += stats.simulation_time_steps_taken();
+        this->total_acceleration += stats.total_acceleration();
+    }
+
+    void Add(const EpisodeTotals& other)
+    {
+        this->episodes += other.episodes;
+        this->success += other.success;
+        this->collision += other.collision;
+        this->limits_violated += other.limits_violated;
+        this->timeout += other.timeout;
+        this->time_steps += other.time_steps;
+        this->success_time_steps += other.success_time_steps;
+        this->total_acceleration += other.total_acceleration;
+        this->mismatches += other.mismatches;
+    }
+};
+
+/* Run one episode of the world with the planner until it is done.
+*  \param[in/out]: planner The planner, reset at the start of the episode
+*  \param[in/out]: reference Optional planner run in lockstep, its commands are compared to the ones of planner
+*  \param[in/out]: mismatches Number of commands that differ from the reference
+*  \param[in/out]: record If not null the records of the episode are appended to it
+*  \param[in]: config The scenario parameters
+*  \param[in]: seed The seed of the episode
+*  \param[in]: simulation_round The round number of the episode
+*  \return: The statistics of the episode
+ */
+inline custom_messages::Statistics RunEpisode(Planner& planner, Planner* reference, long& mismatches, std::string* record,
+                                       const SimConfig& config, uint64_t seed, int32_t simulation_round)
+{
+    WorldSim sim(config, seed, simulation_round);
+    custom_messages::Command command;
+    planner.Reset();
+    if (reference) {reference->Reset();}
+    uint64_t sequence = 0;
+    while (!sim.Done())
+    {
+        if (record)
+        {
+            sequence = ++RecordedStates();
+            RecordWriter::Append(RecordType::WorldState, sequence, sim.State(), *record);
+        }
+        const custom_messages::WorldState& state = sim.State();
+        LOG_EVENT(Debug, WorldState, state.simulation_round(), state.time().sec() + 1e-9 * state.time().nsec(),
+                  state.ego_vehicle().position().x(), state.ego_vehicle().position().y(),
+                  state.ego_vehicle().velocity().x(), state.ego_vehicle().velocity().y());
+        {
+            TRACE_SCOPE(Tick);
+            command.set_ego_car_speed(planner.Plan(sim.State()));
+        }
+        command.set_simulation_round(sim.State().simulation_round());
+        if (record) {RecordWriter::Append(RecordType::Command, sequence, command, *record);}
+        if (reference)
+        {
+            // The reference planner is not traced, only the planner under test
+            TRACE_BIND(nullptr);
+            if (reference->Plan(sim.State()) != command.ego_car_speed()) {mismatches += 1;}
+        }
+        sim.Step(command);
+    }
+    if (record) {RecordWriter::Append(RecordType::Statistics, sequence, sim.Stats(), *record);}
+    const custom_messages::Statistics& stats = sim.Stats();
+    LOG_EVENT(Info, Statistics, stats.success(), stats.collision_detected(), stats.simulation_time_steps_taken(),
+              stats.total_acceleration(), stats.limits_respected());
+    return stats;
+}
+
+#endif // EPISODE_H
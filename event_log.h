@@ -0,0 +1,354 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "slab.h"
+
+/**
+ * Asynchronous structured log of the control loop, levelled at runtime. A log call on the hot
+ * path only checks the level and copies a fixed-size binary record (time, event, source and up
+ * to kLogValues numbers) into a ring buffer of its own thread; it never formats, locks, waits or
+ * allocates once the ring of the thread exists. A background thread drains the rings of all
+ * threads, formats the records as one "time level [source] event key=value ..." line each and
+ * writes them to the log file. When a ring is full the record is dropped and counted instead of
+ * making the planner wait, the drop count is written to the log as it grows and on Close. With
+ * the log closed (the default) a log call costs one relaxed load.
+ * The ring of a thread is created on its first record and lives as long as the process, there
+ * are at most kMaxRings of them; records of further threads are dropped.
+ */
+
+enum class LogLevel : uint8_t
+{
+    Debug,
+    Info,
+    Warn,
+    Error,
+    Off
+};
+
+// The events of the log, see LogEventInfo for their values
+enum class LogEvent : uint16_t
+{
+    WorldState,                                     // A world state taken by the planner
+    Vehicle,                                        // One car of a world state
+    PriorCar,                                       // The car the ego car has to yield to or surpass
+    EgoCar,
+    Yield,                                          // The decision step decided to yield
+    InMargin,                                       // The ego car stopped inside the margin
+    Command,                                        // The planned command
+    RoundStart,
+    Statistics,                                     // The result of a simulation round
+    Count
+};
+
+static const int kLogValues = 6;                    // Numbers a record can carry
+
+// Name and value names of an event
+struct LogEventInfo
+{
+    const char* name;
+    const char* keys[kLogValues];
+};
+
+inline const LogEventInfo& GetLogEventInfo(LogEvent event)
+{
+    static const LogEventInfo infos[] = {
+        { "WorldState", { "round", "time", "x", "y", "vx", "vy" } },
+        { "Vehicle", { "id", "lane", "x", "y", "vx", "vy" } },
+        { "PriorCar", { "pos", "vel", "acc" } },
+        { "EgoCar", { "pos", "vel" } },
+        { "Yield", { "prior_pos", "ego_pos" } },
+        { "InMargin", { "ego_pos" } },
+        { "Command", { "vel", "acc", "jerk" } },
+        { "RoundStart", { "round", "episode" } },
+        { "Statistics", { "success", "collision", "steps", "total_acc", "limits" } },
+    };
+    return infos[(int)event];
+}
+
+inline const char* LogLevelName(LogLevel level)
+{
+    static const char* const names[] = { "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+    return names[(int)level];
+}
+
+/* Parse a level name: debug, info, warn, error or off.
+*  \return: false if the name is unknown
+ */
+inline bool ParseLogLevel(const char* name, LogLevel& level)
+{
+    static const char* const names[] = { "debug", "info", "warn", "error", "off" };
+    for (int l = 0; l <= (int)LogLevel::Off; l++)
+    {
+        if (!std::strcmp(name, names[l])) {level = (LogLevel)l; return true;}
+    }
+    return false;
+}
+
+// One log entry, a cache line
+struct LogRecord
+{
+    uint64_t time_ns;                               // Steady clock
+    LogEvent event;
+    LogLevel level;
+    uint8_t count;                                  // Values set
+    int32_t source;                                 // Source of the thread when it logged, -1 for none
+    double values[kLogValues];
+};
+
+/**
+ * Ring buffer of the records of one thread, for that thread and the writer. The positions only
+ * grow, the producer and the writer keep them on separate cache lines.
+ */
+class LogRing {
+
+public:
+    explicit LogRing(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) {size *= 2;}
+        this->records.reset(new LogRecord[size]);
+        this->mask = size - 1;
+    }
+
+    // The record to fill, null if the ring is full
+    LogRecord* Claim()
+    {
+        const uint64_t head = this->head.load(std::memory_order_relaxed);
+        if (head - this->cached_tail > this->mask)
+        {
+            this->cached_tail = this->tail.load(std::memory_order_acquire);
+            if (head - this->cached_tail > this->mask) {this->dropped.fetch_add(1, std::memory_order_relaxed); return nullptr;}
+        }
+        return &this->records[head & this->mask];
+    }
+
+    // Hand the claimed record to the writer
+    void Publish() { this->head.store(this->head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    /* Pass the published records to f and free them, writer only.
+    *  \return: Number of records
+     */
+    template <class F>
+    size_t Drain(F&& f)
+    {
+        const uint64_t tail = this->tail.load(std::memory_order_relaxed);
+        const uint64_t head = this->head.load(std::memory_order_acquire);
+        for (uint64_t i = tail; i != head; i++) {f(this->records[i & this->mask]);}
+        this->tail.store(head, std::memory_order_release);
+        return (size_t)(head - tail);
+    }
+
+    uint64_t Dropped() const { return this->dropped.load(std::memory_order_relaxed); }
+
+private:
+    // Written by the producer
+    std::atomic<uint64_t> head{0};                  // Position of the next record
+    uint64_t cached_tail = 0;                       // Last tail seen, so a claim only reads tail when the ring looks full
+    std::atomic<uint64_t> dropped{0};               // Records dropped because the ring was full
+    char pad[kCacheLine];
+
+    // Written by the writer
+    std::atomic<uint64_t> tail{0};                  // Position of the oldest record not written yet
+    char pad_tail[kCacheLine];
+
+    std::unique_ptr<LogRecord[]> records;
+    uint64_t mask;                                  // Capacity - 1, the capacity is a power of two
+};
+
+class EventLog {
+
+public:
+    static const int kMaxRings = 256;               // Threads that can log
+
+    static EventLog& Instance()
+    {
+        static EventLog log;
+        return log;
+    }
+
+    ~EventLog()
+    {
+        Close();
+        for (int r = 0; r < kMaxRings; r++) {delete this->rings[r].load(std::memory_order_relaxed);}
+    }
+
+    /* Create the log file and start the writer, an existing file is overwritten.
+    *  \param[in]: path The log file
+    *  \param[in]: level Records below this level are not logged
+    *  \param[in]: ring_capacity Records of a ring created from now on
+    *  \return: false if the file could not be created
+     */
+    bool Open(const std::string& path, LogLevel level, size_t ring_capacity = 4096)
+    {
+        Close();
+        this->file = std::fopen(path.c_str(), "w");
+        if (this->file == nullptr) {return false;}
+        std::setvbuf(this->file, nullptr, _IOFBF, 1 << 20);
+        this->ring_capacity.store(ring_capacity, std::memory_order_relaxed);
+        this->start_ns = Now();
+        this->reported_drops = Dropped();
+        this->running.store(true);
+        this->writer = std::thread(&EventLog::WriterLoop, this);
+        this->level.store(level, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Stop logging, write the records still in the rings and the drop count and close the file
+    void Close()
+    {
+        this->level.store(LogLevel::Off, std::memory_order_relaxed);
+        if (!this->writer.joinable()) {return;}
+        this->running.store(false);
+        this->writer.join();
+        DrainAll();
+        std::fprintf(this->file, "Dropped records: %llu\n", (unsigned long long)Dropped());
+        std::fclose(this->file);
+        this->file = nullptr;
+    }
+
+    bool Enabled(LogLevel level) const { return level >= this->level.load(std::memory_order_relaxed); }
+
+    // Log a record with up to kLogValues numbers, check Enabled first (LOG_EVENT does)
+    template <class... Values>
+    void Write(LogLevel level, LogEvent event, Values... values)
+    {
+        static_assert(sizeof...(Values) <= kLogValues, "Too many values for a log record");
+        LogRing* ring = ThreadRing();
+        if (ring == nullptr) {this->overflow.fetch_add(1, std::memory_order_relaxed); return;}
+        LogRecord* record = ring->Claim();
+        if (record == nullptr) {return;}
+        record->time_ns = Now();
+        record->event = event;
+        record->level = level;
+        record->count = (uint8_t)sizeof...(Values);
+        record->source = ThreadSource();
+        const double numbers[] = { 0.0, (double)values... };
+        std::memcpy(record->values, numbers + 1, sizeof...(Values) * sizeof(double));
+        ring->Publish();
+    }
+
+    /* Name a source in the log, call before Open.
+    *  \param[in]: source The number set with SetSource
+    *  \param[in]: name Printed in brackets in front of the records of the source, empty for none
+     */
+    void NameSource(int32_t source, const std::string& name)
+    {
+        if (source < 0) {return;}
+        if ((size_t)source >= this->source_names.size()) {this->source_names.resize(source + 1);}
+        this->source_names[source] = name;
+    }
+
+    // Set the source of the records the calling thread logs from now on, like the controller it plans for
+    static void SetSource(int32_t source) { ThreadSource() = source; }
+
+    // Records dropped so far because a ring was full or there were too many threads
+    uint64_t Dropped() const
+    {
+        uint64_t dropped = this->overflow.load(std::memory_order_relaxed);
+        for (int r = 0; r < kMaxRings; r++)
+        {
+            const LogRing* ring = this->rings[r].load(std::memory_order_acquire);
+            if (ring) {dropped += ring->Dropped();}
+        }
+        return dropped;
+    }
+
+private:
+    EventLog()
+    {
+        for (int r = 0; r < kMaxRings; r++) {this->rings[r].store(nullptr, std::memory_order_relaxed);}
+    }
+
+    static uint64_t Now()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static int32_t& ThreadSource()
+    {
+        static thread_local int32_t source = -1;
+        return source;
+    }
+
+    // The ring of the calling thread, created on its first record, null once kMaxRings are taken
+    LogRing* ThreadRing()
+    {
+        static thread_local LogRing* ring = nullptr;
+        static thread_local bool registered = false;
+        if (registered) {return ring;}
+        registered = true;
+        const int index = this->ring_count.fetch_add(1, std::memory_order_relaxed);
+        if (index >= kMaxRings) {return nullptr;}
+        ring = new LogRing(this->ring_capacity.load(std::memory_order_relaxed));
+        this->rings[index].store(ring, std::memory_order_release);
+        return ring;
+    }
+
+    void WriterLoop()
+    {
+        while (this->running.load())
+        {
+            // Sleep only when the rings were empty, a busy producer is drained continuously
+            if (DrainAll() == 0) {std::this_thread::sleep_for(std::chrono::milliseconds(5));}
+        }
+    }
+
+    // Write the records of all rings, and the drop count if it grew
+    size_t DrainAll()
+    {
+        size_t written = 0;
+        const int count = std::min((int)kMaxRings, this->ring_count.load(std::memory_order_relaxed));
+        for (int r = 0; r < count; r++)
+        {
+            LogRing* ring = this->rings[r].load(std::memory_order_acquire);
+            if (ring) {written += ring->Drain([this](const LogRecord& record) {Format(record);});}
+        }
+        const uint64_t dropped = Dropped();
+        if (dropped != this->reported_drops)
+        {
+            std::fprintf(this->file, "Dropped records so far: %llu\n", (unsigned long long)dropped);
+            this->reported_drops = dropped;
+        }
+        if (written > 0) {std::fflush(this->file);}
+        return written;
+    }
+
+    void Format(const LogRecord& record)
+    {
+        const LogEventInfo& info = GetLogEventInfo(record.event);
+        const char* name = (record.source >= 0 && (size_t)record.source < this->source_names.size())
+                         ? this->source_names[record.source].c_str() : "";
+        std::fprintf(this->file, "%.6f %s %s%s%s%s", (double)(int64_t)(record.time_ns - this->start_ns) * 1e-9,
+                     LogLevelName(record.level), *name ? "[" : "", name, *name ? "] " : "", info.name);
+        for (int v = 0; v < record.count; v++) {std::fprintf(this->file, " %s=%.9g", info.keys[v], record.values[v]);}
+        std::fputc('\n', this->file);
+    }
+
+    std::atomic<LogLevel> level{LogLevel::Off};     // Lowest level logged, Off while the log is closed
+    std::atomic<LogRing*> rings[kMaxRings];         // Rings of the threads, in the order they were created
+    std::atomic<int> ring_count{0};                 // Threads that tried to create a ring
+    std::atomic<uint64_t> overflow{0};              // Records of threads without a ring
+    std::atomic<size_t> ring_capacity{4096};        // Records of a new ring
+    std::vector<std::string> source_names;          // Names of the sources, by number
+    std::FILE* file = nullptr;
+    uint64_t start_ns = 0;                          // Open time, the time of a record is printed relative to it
+    uint64_t reported_drops = 0;                    // Drop count last written to the log
+    std::atomic<bool> running{false};
+    std::thread writer;
+};
+
+// Log an event if its level is enabled, the values are only evaluated then
+#define LOG_EVENT(level, ...) \
+    do { if (EventLog::Instance().Enabled(LogLevel::level)) {EventLog::Instance().Write(LogLevel::level, LogEvent::__VA_ARGS__);} } while (0)
+
+#endif // EVENT_LOG_H
@@ -0,0 +1,189 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "episode.h"
+#include "event_log.h"
+#include "latency_trace.h"
+#include "planner.h"
+#include "record_log.h"
+#include "world_sim.h"
+
+using namespace std;
+/**
+ * Headless simulation harness. It runs randomized episodes of the in-process world (world_sim.h)
+ * against the planner on all cores without Gazebo, one planner per worker thread, and prints
+ * the aggregated statistics of all episodes at the end.
+ *
+ * Usage: headless_sim [--episodes N] [--threads N] [--seed N] [--min-vehicles N]
+ *                     [--max-vehicles N] [--lanes 123] [--arrival-rate P] [--max-steps N]
+ *                     [--mode reference|kernel|search|qp|analytic] [--verify]
+ *                     [--search-budget-ms T] [--search-segments N] [--search-threads N]
+ *                     [--conflict prior|occupancy|sampled] [--samples M] [--kernel runtime|fixed]
+ *                     [--record FILE] [--log FILE] [--log-level debug|info|warn|error]
+ * With --record all world states, commands and statistics are logged for the replay tool, the
+ * records of an episode are written together.
+ * With --log the event log (event_log.h) is written to FILE, at the info level the statistics
+ * of every episode, at the debug level also every world state, decision and command.
+ * With --conflict sampled the kernel scores its candidates against M sampled trajectories of
+ * every lane 1 car (sampled_prediction.h), the sampling is spread over the --search-threads pool.
+ * With --verify a reference planner runs in lockstep and every command is compared bit-for-bit.
+ */
+
+int main(int _argc, char **_argv)
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    long num_episodes = 10000;
+    unsigned num_threads = std::max(1u, thread::hardware_concurrency());
+    uint64_t seed = 1;
+    PlannerMode mode = PlannerMode::Kernel;
+    bool verify = false;
+    SearchParams search;
+    unsigned search_threads = 0;
+    ConflictModel conflict = ConflictModel::PriorCar;
+    SampleParams sample;
+    bool fixed_kernel = true;
+    string record_path;
+    string log_path;
+    LogLevel log_level = LogLevel::Info;
+    SimConfig config;
+    for (int i = 1; i < _argc; i++)
+    {
+        const char* arg = _argv[i];
+        if (!strcmp(arg, "--verify")) {verify = true; continue;}
+        const char* value = (i + 1 < _argc) ? _argv[i + 1] : nullptr;
+        if (value == nullptr) {cerr << "Missing value for " << arg << endl; return 1;}
+        if (!strcmp(arg, "--episodes")) {num_episodes = atol(value);}
+        else if (!strcmp(arg, "--threads")) {num_threads = std::max(1, atoi(value));}
+        else if (!strcmp(arg, "--seed")) {seed = strtoull(value, nullptr, 10);}
+        else if (!strcmp(arg, "--min-vehicles")) {config.min_vehicles = atoi(value);}
+        else if (!strcmp(arg, "--max-vehicles")) {config.max_vehicles = atoi(value);}
+        else if (!strcmp(arg, "--arrival-rate")) {config.arrival_rate = atof(value);}
+        else if (!strcmp(arg, "--max-steps")) {config.max_steps = atoi(value);}
+        else if (!strcmp(arg, "--mode"))
+        {
+            if (!strcmp(value, "reference")) {mode = PlannerMode::Reference;}
+            else if (!strcmp(value, "kernel")) {mode = PlannerMode::Kernel;}
+            else if (!strcmp(value, "search")) {mode = PlannerMode::JerkSearch;}
+            else if (!strcmp(value, "qp")) {mode = PlannerMode::Qp;}
+            else if (!strcmp(value, "analytic")) {mode = PlannerMode::Analytic;}
+            else {cerr << "Unknown mode " << value << endl; return 1;}
+        }
+        else if (!strcmp(arg, "--search-budget-ms")) {search.time_budget = atof(value) * 1e-3;}
+        else if (!strcmp(arg, "--search-segments")) {search.segments = atoi(value);}
+        else if (!strcmp(arg, "--search-threads")) {search_threads = (unsigned)std::max(0, atoi(value));}
+        else if (!strcmp(arg, "--conflict"))
+        {
+            if (!strcmp(value, "prior")) {conflict = ConflictModel::PriorCar;}
+            else if (!strcmp(value, "occupancy")) {conflict = ConflictModel::Occupancy;}
+            else if (!strcmp(value, "sampled")) {conflict = ConflictModel::Sampled;}
+            else {cerr << "Unknown conflict model " << value << endl; return 1;}
+        }
+        else if (!strcmp(arg, "--samples")) {sample.samples = std::max(1, atoi(value));}
+        else if (!strcmp(arg, "--kernel"))
+        {
+            if (!strcmp(value, "runtime")) {fixed_kernel = false;}
+            else if (!strcmp(value, "fixed")) {fixed_kernel = true;}
+            else {cerr << "Unknown kernel " << value << endl; return 1;}
+        }
+        else if (!strcmp(arg, "--record")) {record_path = value;}
+        else if (!strcmp(arg, "--log")) {log_path = value;}
+        else if (!strcmp(arg, "--log-level"))
+        {
+            if (!ParseLogLevel(value, log_level)) {cerr << "Unknown log level " << value << endl; return 1;}
+        }
+        else if (!strcmp(arg, "--lanes"))
+        {
+            config.lane_mask = 0;
+            for (const char* c = value; *c; c++) {if (*c >= '1' && *c <= '3') {config.lane_mask |= 1 << (*c - '0');}}
+        }
+        else {cerr << "Unknown argument " << arg << endl; return 1;}
+        i++;
+    }
+    if (config.max_vehicles < config.min_vehicles) {config.max_vehicles = config.min_vehicles;}
+
+    // The jerk search of all planners shares one pool, without it every search runs on its worker
+    unique_ptr<ThreadPool> search_pool;
+    if (search_threads > 0) {search_pool.reset(new ThreadPool(search_threads));}
+
+    RecordWriter recorder;
+    if (!record_path.empty() && !recorder.Open(record_path))
+    {
+        cerr << "Cannot create the record log " << record_path << endl;
+        return 1;
+    }
+    if (!log_path.empty() && !EventLog::Instance().Open(log_path, log_level))
+    {
+        cerr << "Cannot create the event log " << log_path << endl;
+        return 1;
+    }
+
+    // Episodes are handed out one by one, so slow episodes do not hold back a whole worker
+    atomic<long> next_episode(0);
+    vector<EpisodeTotals> totals(num_threads);
+    vector<thread> workers;
+    auto wall_start = chrono::steady_clock::now();
+    clock_t cpu_start = clock();
+    for (unsigned w = 0; w < num_threads; w++)
+    {
+        workers.emplace_back([&, w]()
+        {
+            Planner planner(mode, search_pool.get());
+            planner.Search().SetSearchParams(search);
+            planner.SetConflictModel(conflict);
+            planner.Sampler().SetParams(sample);
+            if (!fixed_kernel) {planner.SetKernelProfile(KernelProfile::Runtime);}
+            Planner reference(PlannerMode::Reference);
+#if PLANNER_TRACE
+            LatencyTrace trace;
+            TRACE_BIND(&trace);
+#endif
+            string record;
+            for (long i = next_episode++; i < num_episodes; i = next_episode++)
+            {
+                record.clear();
+                totals[w].Add(RunEpisode(planner, verify ? &reference : nullptr, totals[w].mismatches,
+                                         recorder.IsOpen() ? &record : nullptr, config, seed + i, (int32_t)(i + 1)));
+                if (recorder.IsOpen()) {recorder.WriteRaw(record);}
+            }
+        });
+    }
+    for (thread& worker : workers) {worker.join();}
+    recorder.Close();
+    EventLog::Instance().Close();
+    double wall_time = chrono::duration<double>(chrono::steady_clock::now() - wall_start).count();
+    double cpu_time = double(clock() - cpu_start) / CLOCKS_PER_SEC;
+
+    EpisodeTotals sum;
+    for (const EpisodeTotals& t : totals) {sum.Add(t);}
+    double n = std::max(1L, sum.episodes);
+    cout << "Episodes: " << sum.episodes << " on " << num_threads << " threads" << endl
+         << "Success: " << sum.success << " (" << 100.0 * sum.success / n << "%)" << endl
+         << "Collision: " << sum.collision << " (" << 100.0 * sum.collision / n << "%)" << endl
+         << "Timeout: " << sum.timeout << " (" << 100.0 * sum.timeout / n << "%)" << endl
+         << "Limits violated: " << sum.limits_violated << " (" << 100.0 * sum.limits_violated / n << "%)" << endl
+         << "Mean time steps: " << sum.time_steps / n << endl
+         << "Mean time steps of successful episodes: " << double(sum.success_time_steps) / std::max(1L, sum.success) << endl
+         << "Mean total acceleration: " << sum.total_acceleration / n << endl
+         << "Simulated steps: " << sum.time_steps << " in " << wall_time << " s wall, " << cpu_time << " s CPU ("
+         << sum.time_steps / std::max(wall_time, 1e-9) << " steps/s)" << endl;
+    TRACE_DUMP(cout);
+    if (!log_path.empty())
+    {
+        cout << "Event log records dropped: " << EventLog::Instance().Dropped() << endl;
+    }
+    if (verify)
+    {
+        cout << "Commands different from the reference planner: " << sum.mismatches << endl;
+    }
+
+    google::protobuf::ShutdownProtobufLibrary();
+    return (verify && sum.mismatches > 0) ? 2 : 0;
+}
@@ -0,0 +1,371 @@
+#ifndef JERK_SEARCH_H
+#define JERK_SEARCH_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <vector>
+#include "mpc_kernel.h"
+#include "thread_pool.h"
+
+/**
+ * Jerk sequence search. Instead of applying one jerk of da_list and holding the acceleration for
+ * the whole horizon, the horizon is split into segments and a jerk of da_list is chosen for every
+ * segment, applied at its first step and held for the rest of it. This lets the planner find
+ * profiles like "brake now, accelerate later". The steps are predicted and scored like the
+ * kernel does (the position follows the jerks applied since the tick, see PredictEgocarAcc), so
+ * a sequence with a single jerk in its first segment is exactly a candidate of the kernel, and
+ * the search only returns a different first jerk when a sequence beats all of them. A sequence
+ * whose predicted velocity leaves [min_v, max_v] is infeasible and dropped with its subtree, the
+ * candidates of the kernel are only the fallback when none is feasible. The tree of
+ * sequences is searched depth first with branch and bound: a node is pruned when the cost of its
+ * prefix plus a lower bound of the remaining steps cannot beat the best sequence found so far.
+ * Subtrees are spread over a work-stealing ThreadPool and the search is anytime, it returns the
+ * best sequence found when the time budget of the tick runs out.
+ */
+
+// Parameters of the search
+struct SearchParams
+{
+    int segments = 5;                               // Number of jerk choices over the horizon
+    double time_budget = 0.02;                      // Time budget of one tick in seconds
+    int split_depth = 2;                            // Subtrees below this depth are run as pool tasks
+};
+
+// Counters of the last search
+struct SearchStats
+{
+    long nodes;                                     // Expanded nodes
+    long pruned;                                    // Nodes cut by the lower bound or the velocity limits
+    bool complete;                                  // False if the time budget ran out
+};
+
+class JerkSearch {
+
+public:
+    static const int kMaxSegments = 16;
+
+    /* Constructor
+    *  \param[in]: params The planner parameters, max_a and min_a are enforced on every jerk, min_v and max_v on every step
+    *  \param[in]: search The search parameters
+    *  \param[in]: pool The pool running the subtrees, the search runs on the calling thread if null
+     */
+    JerkSearch(const MpcParams& params, const SearchParams& search = SearchParams(), ThreadPool* pool = nullptr)
+        : params(params), pool(pool)
+    {
+        this->prior_in_region.resize(params.K);
+        this->prior_near.resize(params.K);
+        SetSearchParams(search);
+    }
+
+    void SetSearchParams(const SearchParams& search)
+    {
+        this->search = search;
+        this->search.segments = std::max(1, std::min(std::min(search.segments, (int)kMaxSegments), this->params.K));
+        this->segment_start.resize(this->search.segments + 1);
+        for (int s = 0; s <= this->search.segments; s++)
+        {
+            this->segment_start[s] = s * this->params.K / this->search.segments;
+        }
+        this->max_jerk = 0.0;
+        for (float da : this->params.da_list) {this->max_jerk = std::max(this->max_jerk, (double)std::abs(da));}
+    }
+
+    const SearchParams& Params() const { return this->search; }
+    const SearchStats& Stats() const { return this->stats; }
+
+    // Indices into da_list of the best sequence of the last search, one per segment
+    const std::vector<int>& BestSequence() const { return this->best_sequence; }
+
+    /* Search the best jerk sequence and return its first step.
+    *  \param[in]: ego The current position and velocity of the ego car
+    *  \param[in]: prior The current position, velocity and acceleration of the prior car
+    *  \param[in]: acc_cmd The acceleration command from the previous time step
+    *  \param[in]: yield The YIELD signal of the decision step
+    *  \param[in]: grid Optional occupancy of all cars, replaces the collision check against the prior car
+    *  \return: The jerk of the first segment and the resulting acceleration and sequence cost
+     */
+    MpcResult Solve(const EgoState& ego, const PriorCarState& prior, double acc_cmd, bool yield,
+                    const OccupancyGrid* grid = nullptr)
+    {
+        this->grid = grid;
+        this->deadline = std::chrono::steady_clock::now() +
+                         std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(this->search.time_budget));
+        this->yield = yield;
+        this->stop = false;
+        this->node_count = 0;
+        this->pruned_count = 0;
+        PredictPrior(prior);
+
+        Node root = { ego.pos, ego.vel, acc_cmd, ego.vel, 0.0, 0.0, 0.0, 0 };
+        int sequence[kMaxSegments] = {};
+
+        // Seed the incumbent with the feasible candidates of the kernel, one jerk followed by constant
+        // acceleration, so the search can only improve on the kernel. If none of them keeps the velocity
+        // within its limits, the cheapest one is the answer unless the search finds a feasible sequence.
+        this->best_cost = std::numeric_limits<double>::infinity();
+        this->best_sequence.assign(this->search.segments, ZeroJerk());
+        int fallback = -1;
+        double fallback_cost = std::numeric_limits<double>::infinity();
+        for (int i = 0; i < (int)this->params.da_list.size(); i++)
+        {
+            if (!Valid(root.acc, i)) {continue;}
+            sequence[0] = i;
+            Node node = root;
+            bool feasible = Advance(node, this->params.da_list[i], 0);
+            for (int s = 1; s < this->search.segments; s++)
+            {
+                sequence[s] = ZeroJerk();
+                feasible = Advance(node, 0.0f, s) && feasible;
+            }
+            if (feasible) {Offer(FinalCost(node), sequence);}
+            else if (fallback < 0 || FinalCost(node) < fallback_cost)
+            {
+                fallback = i;
+                fallback_cost = FinalCost(node);
+            }
+        }
+
+        // Spread the subtrees below split_depth over the pool
+        {
+            TaskGroup group(this->pool);
+            Split(root, 0, sequence, group);
+        }
+        this->stats.nodes = this->node_count;
+        this->stats.pruned = this->pruned_count;
+        this->stats.complete = !this->stop;
+
+        MpcResult result;
+        result.index = this->best_sequence[0];
+        if (BestCost() == std::numeric_limits<double>::infinity() && fallback >= 0)
+        {
+            result.index = fallback;
+            this->best_cost = fallback_cost;
+        }
+        result.acc = this->params.da_list[result.index] + acc_cmd;
+        result.cost = this->best_cost;
+        return result;
+    }
+
+private:
+    // State of the ego car after the steps of a sequence prefix
+    struct Node
+    {
+        double pos;
+        double vel;
+        double acc;
+        double pos_vel;                             // Velocity of the position prediction, with the jerks as acceleration
+        double da;                                  // Sum of the jerks applied since the tick
+        double cost;                                // Velocity and acceleration terms of the prefix
+        double points;                              // Points in the obstacle region of the prefix
+        int step;                                   // First step not simulated yet
+    };
+
+    // Index of the zero jerk in da_list, or of the smallest one
+    int ZeroJerk() const
+    {
+        int index = 0;
+        for (int i = 1; i < (int)this->params.da_list.size(); i++)
+        {
+            if (std::abs(this->params.da_list[i]) < std::abs(this->params.da_list[index])) {index = i;}
+        }
+        return index;
+    }
+
+    // Same limit check as PredictEgocarAcc, the jerk must keep the acceleration within min_a and max_a
+    bool Valid(double acc, int i) const
+    {
+        const float da = this->params.da_list[i];
+        return acc + da <= this->params.max_a && acc + da >= this->params.min_a;
+    }
+
+    void PredictPrior(const PriorCarState& prior)
+    {
+        for (int k = 0; k < this->params.K; k++)
+        {
+            double pos = prior.pos + prior.vel*k*this->params.dt + 0.5*prior.acc*std::pow(k*this->params.dt,2);
+            pos = HoldAtStop(prior, k*this->params.dt, pos);
+            this->prior_in_region[k] = (pos < 0 && pos > this->params.yield_line);
+            this->prior_near[k] = (std::abs(pos) < 5);
+        }
+    }
+
+    /* Simulate the steps of segment s with the given jerk, applied at the first step of the segment.
+    *  Like the kernel, step k is scored with the velocity vel + acc*dt*k and the position
+    *  pos + vel0*k*dt + 0.5*da*(k*dt)^2 of PredictEgocarAcc, where the jerks da since the tick
+    *  are the acceleration of the position and vel0 = vel + da*dt. Valid keeps the acceleration
+    *  within [min_a, max_a], the velocity is checked against [min_v, max_v] after every step.
+    *  \return: false if the velocity left its limits, the node and all its completions are infeasible
+     */
+    bool Advance(Node& node, float jerk, int s) const
+    {
+        const double dt = this->params.dt;
+        node.acc += jerk;
+        node.da += jerk;
+        node.pos_vel += jerk * dt;
+        for (int k = this->segment_start[s]; k < this->segment_start[s + 1]; k++)
+        {
+            const bool in_region = this->yield ? (node.pos > this->params.margin) : (node.pos < 0);
+            if (in_region && this->prior_in_region[k]) {node.points += 1.0;}
+            const bool near = this->grid ? this->grid->Occupied(k, node.pos) : (std::abs(node.pos) < 5 && this->prior_near[k]);
+            if (near) {node.points += 10.0;}
+            const double dv = this->params.vel_target - node.vel;
+            node.cost += this->params.Cv*dv*dv + this->params.Ca*node.acc*node.acc;
+            node.pos += node.pos_vel * dt + 0.5 * node.da * dt * dt;
+            node.pos_vel += node.da * dt;
+            node.vel += node.acc * dt;
+            if (node.vel > this->params.max_v || node.vel < this->params.min_v) {return false;}
+        }
+        node.step = this->segment_start[s + 1];
+        return true;
+    }
+
+    // Cost of a complete sequence, the points are squared and counted on every step like in CalculateCost
+    double FinalCost(const Node& node) const
+    {
+        return node.cost + this->params.K * node.points * node.points;
+    }
+
+    /* Lower bound of the cost of any completion of the node. The acceleration changes at most by
+    *  the maximum jerk per step (a jerk per segment is less), so the velocity can at most follow
+    *  maximum jerk up to max_a and never exceeds max_v on a feasible sequence, and the acceleration
+    *  can at most shrink by the maximum jerk per step.
+     */
+    double LowerBound(const Node& node) const
+    {
+        const double dt = this->params.dt;
+        double bound = FinalCost(node);
+        double acc_up = node.acc, vel_up = node.vel, acc_abs = std::abs(node.acc);
+        for (int k = node.step; k < this->params.K; k++)
+        {
+            acc_up = std::min(this->params.max_a, acc_up + this->max_jerk);
+            acc_abs = std::max(0.0, acc_abs - this->max_jerk);
+            const double dv = std::max(0.0, this->params.vel_target - vel_up);
+            bound += this->params.Cv*dv*dv + this->params.Ca*acc_abs*acc_abs;
+            vel_up = std::min(this->params.max_v, vel_up + acc_up * dt);
+        }
+        return bound;
+    }
+
+    // Update the best sequence if cost is lower
+    void Offer(double cost, const int* sequence)
+    {
+        std::lock_guard<std::mutex> lock(this->best_mutex);
+        if (cost < this->best_cost)
+        {
+            this->best_cost = cost;
+            this->best_sequence.assign(sequence, sequence + this->search.segments);
+        }
+    }
+
+    double BestCost() const { return this->best_cost.load(std::memory_order_relaxed); }
+
+    // Expand the first split_depth levels on the calling thread and queue the subtrees below
+    void Split(const Node& node, int depth, int* sequence, TaskGroup& group)
+    {
+        if (this->pool == nullptr)
+        {
+            // Search on the calling thread without wrapping it into a task, which would allocate
+            long pruned = 0;
+            Search(node, depth, sequence, pruned);
+            this->pruned_count += pruned;
+            return;
+        }
+        if (depth >= this->search.split_depth || depth >= this->search.segments)
+        {
+            std::array<int, kMaxSegments> prefix = {};
+            std::copy(sequence, sequence + depth, prefix.begin());
+            group.Run([this, node, depth, prefix]()
+            {
+                std::array<int, kMaxSegments> local = prefix;
+                long pruned = 0;
+                Search(node, depth, local.data(), pruned);
+                this->pruned_count += pruned;
+            });
+            return;
+        }
+        for (int i = 0; i < (int)this->params.da_list.size(); i++)
+        {
+            if (!Valid(node.acc, i)) {continue;}
+            Node child = node;
+            if (!Advance(child, this->params.da_list[i], depth)) {continue;}
+            sequence[depth] = i;
+            Split(child, depth + 1, sequence, group);
+        }
+    }
+
+    // Depth first branch and bound below node, children with the lowest bound first
+    void Search(const Node& node, int depth, int* sequence, long& pruned)
+    {
+        if (this->stop.load(std::memory_order_relaxed)) {return;}
+        // The counter is shared by all tasks, so the clock is read every 256 nodes of the whole search
+        if ((this->node_count.fetch_add(1, std::memory_order_relaxed) & 255) == 255 &&
+            std::chrono::steady_clock::now() > this->deadline)
+        {
+            this->stop = true;
+            return;
+        }
+        if (depth == this->search.segments)
+        {
+            double cost = FinalCost(node);
+            if (cost < BestCost()) {Offer(cost, sequence);}
+            return;
+        }
+        Node children[kMaxCandidates];
+        double bounds[kMaxCandidates];
+        int order[kMaxCandidates];
+        int num_children = 0;
+        const int num_candidates = std::min((int)this->params.da_list.size(), (int)kMaxCandidates);
+        for (int i = 0; i < num_candidates; i++)
+        {
+            if (!Valid(node.acc, i)) {continue;}
+            children[i] = node;
+            if (!Advance(children[i], this->params.da_list[i], depth))
+            {
+                pruned++;
+                continue;
+            }
+            bounds[i] = LowerBound(children[i]);
+            order[num_children++] = i;
+        }
+        std::sort(order, order + num_children, [&bounds](int a, int b) {return bounds[a] < bounds[b];});
+        for (int c = 0; c < num_children; c++)
+        {
+            const int i = order[c];
+            if (bounds[i] >= BestCost())
+            {
+                pruned += num_children - c;
+                break;
+            }
+            sequence[depth] = i;
+            Search(children[i], depth + 1, sequence, pruned);
+        }
+    }
+
+private:
+    static const int kMaxCandidates = 16;
+
+    const MpcParams params;
+    SearchParams search;
+    ThreadPool* pool;                               // Runs the subtrees, not owned
+    std::vector<int> segment_start;                 // First step of every segment, segment_start[segments] == K
+    double max_jerk;                                // Largest absolute jerk of da_list
+    std::vector<char> prior_in_region;              // If the prior car is between yield_line and the intersection at step k
+    std::vector<char> prior_near;                   // If the prior car is near the intersection at step k
+    bool yield;                                     // YIELD signal of the current search
+    const OccupancyGrid* grid = nullptr;            // Occupancy of all cars in the current search, if any
+    std::chrono::steady_clock::time_point deadline; // End of the time budget of the current search
+    std::atomic<bool> stop{false};                  // Set when the deadline passed
+    std::atomic<double> best_cost{0.0};             // Cost of the best sequence, read without lock for pruning
+    std::mutex best_mutex;                          // Protects best_sequence and updates of best_cost
+    std::vector<int> best_sequence;                 // Best sequence found so far
+    std::atomic<long> node_count{0};                // Expanded nodes of all tasks
+    std::atomic<long> pruned_count{0};
+    SearchStats stats = { 0, 0, true };
+};
+
+#endif // JERK_SEARCH_H
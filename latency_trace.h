@@ -0,0 +1,334 @@
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * Per-stage latency tracing of the control loop. Every probe measures its scope with the
+ * monotonic clock and records the duration into a lock-free log-linear histogram (16 sub-buckets
+ * per power of two, so percentiles are within about 6%). Every owner of a planner (a controller,
+ * a simulation worker) has its own trace with one set of histograms for its current simulation
+ * round, one for its previous round and one for all rounds, so the rounds of different worlds
+ * never mix. A thread records into the trace bound to it with TRACE_BIND and probes of an
+ * unbound thread record nothing, like the reference planner of headless_sim --verify.
+ * TRACE_DUMP prints p50/p99/p99.9/max per stage of all traces merged at any time.
+ * Build with PLANNER_TRACE set to 0 to compile every probe out.
+ */
+
+#ifndef PLANNER_TRACE
+#define PLANNER_TRACE 1
+#endif
+
+// The traced stages of a tick
+enum class TraceStage
+{
+    Parse,                                          // Receiving the world state into the mailbox of the planner
+    SetPriorCar,
+    MakeDecision,
+    PredictEgocarAcc,                               // Also the kernel, search or occupancy grid evaluating all candidates
+    CalculateCost,
+    SetVel,
+    Publish,
+    Tick,                                           // Planning one world state, from the mailbox to the command
+    Count
+};
+
+inline const char* TraceStageName(TraceStage stage)
+{
+    static const char* const names[] = { "Parse", "SetPriorCar", "MakeDecision", "PredictEgocarAcc",
+                                         "CalculateCost", "SetVel", "Publish", "Tick" };
+    return names[(int)stage];
+}
+
+// Lock-free histogram of durations in nanoseconds
+class LatencyHistogram {
+
+public:
+    static const int kSubBuckets = 16;
+    static const int kBuckets = 64 * kSubBuckets;
+
+    LatencyHistogram() { Clear(); }
+
+    void Record(uint64_t ns)
+    {
+        this->buckets[Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        this->count.fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = this->max_ns.load(std::memory_order_relaxed);
+        while (ns > max && !this->max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+    }
+
+    void Clear()
+    {
+        for (int b = 0; b < kBuckets; b++) {this->buckets[b].store(0, std::memory_order_relaxed);}
+        this->count.store(0, std::memory_order_relaxed);
+        this->max_ns.store(0, std::memory_order_relaxed);
+    }
+
+    // Add the counts of another histogram
+    void Merge(const LatencyHistogram& other)
+    {
+        for (int b = 0; b < kBuckets; b++)
+        {
+            this->buckets[b].fetch_add(other.buckets[b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        this->count.fetch_add(other.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t other_max = other.max_ns.load(std::memory_order_relaxed);
+        uint64_t max = this->max_ns.load(std::memory_order_relaxed);
+        while (other_max > max && !this->max_ns.compare_exchange_weak(max, other_max, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t Count() const { return this->count.load(std::memory_order_relaxed); }
+    uint64_t Max() const { return this->max_ns.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket holding the p quantile (0 < p <= 1)
+    uint64_t Percentile(double p) const
+    {
+        const uint64_t total = Count();
+        if (total == 0) {return 0;}
+        uint64_t rank = (uint64_t)(p * total + 0.999999);
+        if (rank < 1) {rank = 1;}
+        uint64_t seen = 0;
+        for (int b = 0; b < kBuckets; b++)
+        {
+            seen += this->buckets[b].load(std::memory_order_relaxed);
+            if (seen >= rank) {return std::min(UpperBound(b), Max());}
+        }
+        return Max();
+    }
+
+private:
+    static int Bucket(uint64_t ns)
+    {
+        if (ns < (uint64_t)kSubBuckets) {return (int)ns;}
+        const int msb = 63 - __builtin_clzll(ns);
+        const int shift = msb - 4;
+        const int bucket = (shift + 1) * kSubBuckets + (int)((ns >> shift) & (kSubBuckets - 1));
+        return bucket < kBuckets ? bucket : kBuckets - 1;
+    }
+
+    static uint64_t UpperBound(int bucket)
+    {
+        if (bucket < kSubBuckets) {return (uint64_t)bucket;}
+        const int shift = bucket / kSubBuckets - 1;
+        const uint64_t sub = (uint64_t)(bucket % kSubBuckets);
+        return ((kSubBuckets + sub + 1) << shift) - 1;
+    }
+
+    std::atomic<uint64_t> buckets[kBuckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> max_ns;
+};
+
+// Histograms of all stages for the current round, the previous round and all rounds of one owner
+class LatencyTrace {
+
+public:
+    LatencyTrace() { Traces().Add(this); }
+    ~LatencyTrace() { Traces().Remove(this); }
+    LatencyTrace(const LatencyTrace&) = delete;
+    LatencyTrace& operator=(const LatencyTrace&) = delete;
+
+    // The trace bound to the calling thread, null if none
+    static LatencyTrace* Active() { return ActiveSlot(); }
+
+    void Record(TraceStage stage, uint64_t ns)
+    {
+        this->current[(int)stage].Record(ns);
+    }
+
+    /* Start a new simulation round, the histograms of the finished round become the previous
+    *  round and are added to the totals. Meant to be called from the thread running the ticks of the owner.
+     */
+    void BeginRound(int32_t round)
+    {
+        if (round == this->round.load(std::memory_order_relaxed)) {return;}
+        for (int s = 0; s < kStages; s++)
+        {
+            this->previous[s].Clear();
+            this->previous[s].Merge(this->current[s]);
+            this->total[s].Merge(this->current[s]);
+            this->current[s].Clear();
+        }
+        this->previous_round.store(this->round.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        this->round.store(round, std::memory_order_relaxed);
+    }
+
+    /* Print p50/p99/p99.9/max of every stage in microseconds.
+    *  \param[in]: out The stream to print to
+    *  \param[in]: deadline_us The deadline of a tick, the margin of the slowest tick is printed against it
+     */
+    void Dump(std::ostream& out, double deadline_us = 100000.0) const
+    {
+        DumpTable(out, "Current round " + std::to_string(this->round.load(std::memory_order_relaxed)), this->current, deadline_us);
+        DumpTable(out, "Previous round " + std::to_string(this->previous_round.load(std::memory_order_relaxed)), this->previous, deadline_us);
+        LatencyHistogram all[kStages];
+        AddAllRounds(all);
+        DumpTable(out, "All rounds", all, deadline_us);
+    }
+
+    /* Print the traces of all owners, the live ones and the destroyed ones. A single live trace is
+    *  printed with its rounds, several are merged into one table of all rounds since their rounds
+    *  are not the same.
+    *  \param[in]: out The stream to print to
+    *  \param[in]: deadline_us The deadline of a tick
+     */
+    static void DumpAll(std::ostream& out, double deadline_us = 100000.0)
+    {
+        Registry& registry = Traces();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        if (registry.traces.size() == 1 && registry.retired == 0)
+        {
+            registry.traces[0]->Dump(out, deadline_us);
+            return;
+        }
+        LatencyHistogram all[kStages];
+        for (int s = 0; s < kStages; s++) {all[s].Merge(registry.finished[s]);}
+        for (const LatencyTrace* trace : registry.traces) {trace->AddAllRounds(all);}
+        const size_t count = registry.traces.size() + registry.retired;
+        DumpTable(out, "All rounds of " + std::to_string(count) + (count == 1 ? " trace" : " traces"), all, deadline_us);
+    }
+
+private:
+    static const int kStages = (int)TraceStage::Count;
+
+    // All traces of the process, so they can be dumped together
+    struct Registry
+    {
+        std::mutex mutex;
+        std::vector<LatencyTrace*> traces;          // Live traces
+        LatencyHistogram finished[kStages];         // All rounds of the destroyed traces
+        size_t retired = 0;                         // Number of destroyed traces
+
+        void Add(LatencyTrace* trace)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->traces.push_back(trace);
+        }
+
+        // The histograms of a destroyed trace are kept for the dump at the end of the process
+        void Remove(LatencyTrace* trace)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->traces.erase(std::find(this->traces.begin(), this->traces.end(), trace));
+            trace->AddAllRounds(this->finished);
+            this->retired++;
+        }
+    };
+
+    static Registry& Traces()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    static LatencyTrace*& ActiveSlot()
+    {
+        static thread_local LatencyTrace* active = nullptr;
+        return active;
+    }
+
+    // Add the finished and the current rounds to the histograms
+    void AddAllRounds(LatencyHistogram* all) const
+    {
+        for (int s = 0; s < kStages; s++)
+        {
+            all[s].Merge(this->total[s]);
+            all[s].Merge(this->current[s]);
+        }
+    }
+
+    static void DumpTable(std::ostream& out, const std::string& title, const LatencyHistogram* histograms, double deadline_us)
+    {
+        out << "Latency [us] " << title << std::endl
+            << std::setw(18) << std::left << "stage" << std::right << std::setw(10) << "count" << std::setw(10) << "p50"
+            << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::setw(10) << "max" << std::endl;
+        for (int s = 0; s < kStages; s++)
+        {
+            const LatencyHistogram& h = histograms[s];
+            if (h.Count() == 0) {continue;}
+            out << std::setw(18) << std::left << TraceStageName((TraceStage)s) << std::right << std::setw(10) << h.Count()
+                << std::fixed << std::setprecision(1)
+                << std::setw(10) << h.Percentile(0.5) * 1e-3 << std::setw(10) << h.Percentile(0.99) * 1e-3
+                << std::setw(10) << h.Percentile(0.999) * 1e-3 << std::setw(10) << h.Max() * 1e-3 << std::endl;
+            out.unsetf(std::ios::floatfield);
+        }
+        const LatencyHistogram& tick = histograms[(int)TraceStage::Tick];
+        if (tick.Count() > 0)
+        {
+            out << "Slowest tick uses " << std::fixed << std::setprecision(3) << 100.0 * tick.Max() * 1e-3 / deadline_us
+                << "% of the " << std::setprecision(0) << deadline_us << " us deadline" << std::endl;
+            out.unsetf(std::ios::floatfield);
+            out << std::setprecision(6);
+        }
+    }
+
+    LatencyHistogram current[kStages];
+    LatencyHistogram previous[kStages];
+    LatencyHistogram total[kStages];                // Finished rounds
+    std::atomic<int32_t> round{0};
+    std::atomic<int32_t> previous_round{0};
+
+    friend class TraceBinding;
+};
+
+// Binds a trace to the calling thread for its scope, null for a scope that is not traced
+class TraceBinding {
+
+public:
+    explicit TraceBinding(LatencyTrace* trace)
+        : previous(LatencyTrace::ActiveSlot())
+    {
+        LatencyTrace::ActiveSlot() = trace;
+    }
+
+    ~TraceBinding() { LatencyTrace::ActiveSlot() = this->previous; }
+
+private:
+    LatencyTrace* const previous;
+};
+
+// Records the duration of its scope into a stage of the trace bound to the thread
+class TraceScope {
+
+public:
+    explicit TraceScope(TraceStage stage)
+        : trace(LatencyTrace::Active()), stage(stage),
+          start(this->trace ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point()) {}
+
+    ~TraceScope()
+    {
+        if (!this->trace) {return;}
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->start).count();
+        this->trace->Record(this->stage, (uint64_t)ns);
+    }
+
+private:
+    LatencyTrace* const trace;
+    const TraceStage stage;
+    const std::chrono::steady_clock::time_point start;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#if PLANNER_TRACE
+#define TRACE_SCOPE(stage) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(TraceStage::stage)
+#define TRACE_BIND(trace) TraceBinding TRACE_CONCAT(trace_binding_, __LINE__)(trace)
+#define TRACE_BEGIN_ROUND(round) do { if (LatencyTrace* trace_ = LatencyTrace::Active()) {trace_->BeginRound(round);} } while (0)
+#define TRACE_DUMP(out) LatencyTrace::DumpAll(out)
+#else
+#define TRACE_SCOPE(stage) do {} while (0)
+#define TRACE_BIND(trace) do {} while (0)
+#define TRACE_BEGIN_ROUND(round) do {} while (0)
+#define TRACE_DUMP(out) do {} while (0)
+#endif
+
+#endif // LATENCY_TRACE_H
@@ -0,0 +1,88 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+/**
+ * Single-slot mailbox in which the latest message wins, for one producer and one consumer.
+ * It is a triple buffer: the producer fills its back buffer and swaps it with the middle one,
+ * the consumer swaps its front buffer with the middle one when it holds a newer message. Both
+ * swaps are a single atomic exchange, so neither side ever waits for the other and an unread
+ * message is simply overwritten by the next one. The buffers are reused, so messages that keep
+ * their storage when they are overwritten (like protobuf messages) do not allocate once warm.
+ * The consumer can block until there is a new message or the mailbox is closed.
+ */
+template <class T>
+class LatestMailbox {
+
+public:
+    LatestMailbox() {}
+
+    // The buffer for the next message, owned by the producer until Put
+    T& Slot() { return this->buffers[this->back]; }
+
+    /* Hand the message in Slot() over to the consumer, replacing an unread one.
+    *  \return: true if an unread message was dropped
+     */
+    bool Put()
+    {
+        const int previous = this->middle.exchange(this->back | kFresh, std::memory_order_acq_rel);
+        this->back = previous & kIndex;
+        // Take the wait lock once, so the consumer cannot miss the wake up between its check and its wait
+        { std::lock_guard<std::mutex> lock(this->wait_mutex); }
+        this->wait_cv.notify_one();
+        return (previous & kFresh) != 0;
+    }
+
+    /* Take the latest message if there is a new one, it stays valid until the next Take.
+    *  \return: The message, null if there is no new message since the last Take
+     */
+    const T* Take()
+    {
+        if (!HasNew()) {return nullptr;}
+        this->front = this->middle.exchange(this->front, std::memory_order_acq_rel) & kIndex;
+        return &this->buffers[this->front];
+    }
+
+    /* Block until there is a new message and take it.
+    *  \return: The message, null once the mailbox is closed
+     */
+    const T* WaitTake()
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->wait_mutex);
+            this->wait_cv.wait(lock, [this]() {return this->closed || HasNew();});
+            if (this->closed) {return nullptr;}
+        }
+        return Take();
+    }
+
+    // If there is a message that was not taken yet
+    bool HasNew() const { return (this->middle.load(std::memory_order_acquire) & kFresh) != 0; }
+
+    // Wake up the consumer, WaitTake returns null from now on
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->wait_mutex);
+            this->closed = true;
+        }
+        this->wait_cv.notify_all();
+    }
+
+private:
+    static const int kIndex = 3;                    // Bits of the buffer index
+    static const int kFresh = 4;                    // Set while the middle buffer holds an unread message
+
+    T buffers[3];
+    int back = 0;                                   // Buffer of the producer
+    std::atomic<int> middle{1};                     // Buffer in between, with the kFresh flag
+    int front = 2;                                  // Buffer of the consumer
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;                // Wakes up the consumer when a message is put
+    bool closed = false;
+};
+
+#endif // MAILBOX_H
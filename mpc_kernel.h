@@ -0,0 +1,427 @@
+#ifndef MPC_KERNEL_H
+#define MPC_KERNEL_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "occupancy_grid.h"
+#include "sampled_prediction.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Standalone MPC planning kernel. It evaluates every jerk candidate of da_list over the
+ * prediction horizon on plain ego and prior car states, without any Gazebo or protobuf types.
+ * Candidates are stored as structure of arrays and are the SIMD lanes (4 candidates per AVX2
+ * register, scalar fallback without AVX2), the horizon is walked in order for each lane.
+ * Every lane performs the same floating point operations in the same order as the scalar
+ * PredictEgocarAcc and CalculateCost of the Planner, so the selected candidate is bit-for-bit
+ * the same. Build without FMA contraction (-ffp-contract=off) to keep it that way.
+ * With an OccupancyGrid the collision points come from the predictions of all cars in the grid
+ * instead of the prior car alone. With a SampledPrediction the near flags of the prior car
+ * become the fraction of sampled trajectories near the intersection, and every candidate gets
+ * the probability that it meets one of the samples as an extra cost term, weighted by Cp.
+ * The kernel is a template over where its parameters come from: MpcKernel reads them from
+ * MpcParams at run time, FixedMpcKernel (mpc_profiles.h) has them as compile-time constants.
+ */
+
+// Plain state of the ego car along its lane (x axis)
+struct EgoState
+{
+    double pos;
+    double vel;
+};
+
+// Plain state of the prior car along its lane (y axis)
+struct PriorCarState
+{
+    double pos;
+    double vel;
+    double acc;
+};
+
+/* Hold a braking car where it stops. With constant acceleration a car braking to a standstill
+*  would back up, instead it stays at the position where its velocity reaches 0, like the
+*  samples of SampledPrediction.
+*  \param[in]: prior The current state of the car
+*  \param[in]: t The time of the prediction
+*  \param[in]: pos The position at time t with constant acceleration
+*  \return: pos, or the stop position if the car is standing still at time t
+ */
+inline double HoldAtStop(const PriorCarState& prior, double t, double pos)
+{
+    if (prior.acc < 0 && prior.vel + prior.acc*t < 0)
+    {
+        const double vel = std::max(prior.vel, 0.0);
+        return prior.pos - 0.5*vel*vel/prior.acc;
+    }
+    return pos;
+}
+
+// The parameters of the deployed planner as constants, DefaultProfile of mpc_profiles.h is compiled from them
+struct MpcDefaults
+{
+    static constexpr int K = 50;                    // Number of steps for prediction horizon
+    static constexpr double Cv = 1.0;               // Factor for velocity term in cost function
+    static constexpr double Ca = 2.0;               // Factor for acceleration term in cost function
+    static constexpr double margin = -10.0;         // Margin as the safety distance before the intersection
+    static constexpr double vel_target = 20.0;      // Take max velocity as the target velocity
+    static constexpr double max_a = 1.99, min_a = -1.99, max_v = 20.0, min_v = 0.0; // Acceleration and velocity constraints setup
+    static constexpr float dt = 0.1f;               // Time step in seconds
+    static constexpr double yield_line = -20;       // In the yield line ego car should defer to the prior car
+    static constexpr std::array<float, 5> DaList() { return {{ (float)-0.19, (float)-0.1, 0.0f, (float)0.1, (float)0.19 }}; } // Jerk constraints setup
+};
+
+// Planner parameters, the defaults are the ones of the deployed planner
+struct MpcParams
+{
+    int K = MpcDefaults::K;                         // Number of steps for prediction horizon
+    double Cv = MpcDefaults::Cv;                    // Factor for velocity term in cost function
+    double Ca = MpcDefaults::Ca;                    // Factor for acceleration term in cost function
+    double margin = MpcDefaults::margin;            // Margin as the safety distance before the intersection
+    double vel_target = MpcDefaults::vel_target;    // Take max velocity as the target velocity
+    double max_a = MpcDefaults::max_a, min_a = MpcDefaults::min_a, max_v = MpcDefaults::max_v, min_v = MpcDefaults::min_v; // Acceleration and velocity constraints setup
+    std::vector<float> da_list = DefaultDaList();   // Jerk constraints setup
+    float dt = MpcDefaults::dt;                     // Time step in seconds
+    double yield_line = MpcDefaults::yield_line;    // In the yield line ego car should defer to the prior car
+
+private:
+    static std::vector<float> DefaultDaList()
+    {
+        const std::array<float, 5> da_list = MpcDefaults::DaList();
+        return std::vector<float>(da_list.begin(), da_list.end());
+    }
+};
+
+// The candidate chosen by the kernel
+struct MpcResult
+{
+    int index;                                      // Index of the chosen jerk in da_list, -1 if no candidate is valid
+    double acc;                                     // The chosen acceleration, acc_cmd + da_list[index]
+    double cost;                                    // Cost of the chosen acceleration
+};
+
+/**
+ * Parameters of the kernel read from MpcParams at run time, with the horizon time terms
+ * precomputed once.
+ */
+class RuntimeMpcConfig {
+
+public:
+    RuntimeMpcConfig(const MpcParams& params = MpcParams())
+        : params(params)
+    {
+        this->step_sq.resize(params.K);
+        for (int k = 0; k < params.K; k++)
+        {
+            this->step_sq[k] = std::pow(k*params.dt,2);
+        }
+    }
+
+    int K() const { return this->params.K; }
+    float Dt() const { return this->params.dt; }
+    double Cv() const { return this->params.Cv; }
+    double Ca() const { return this->params.Ca; }
+    double Margin() const { return this->params.margin; }
+    double VelTarget() const { return this->params.vel_target; }
+    double MaxA() const { return this->params.max_a; }
+    double MinA() const { return this->params.min_a; }
+    double MinV() const { return this->params.min_v; }
+    double YieldLine() const { return this->params.yield_line; }
+    int NumCandidates() const { return (int)this->params.da_list.size(); }
+    float Da(int i) const { return this->params.da_list[i]; }
+    double StepSq(int k) const { return this->step_sq[k]; }  // (k*dt)^2
+    const MpcParams& Params() const { return this->params; }
+
+private:
+    MpcParams params;
+    std::vector<double> step_sq;                    // (k*dt)^2 for every step of the horizon
+};
+
+template <class Config>
+class BasicMpcKernel {
+
+public:
+    /* Constructor
+    *  Allocate the candidate lanes and the flags of the prior car over the horizon
+    *  \param[in]: config The planner parameters
+     */
+    explicit BasicMpcKernel(const Config& config = Config())
+        : config(config)
+    {
+        const int K = this->config.K();
+        this->num_candidates = this->config.NumCandidates();
+        this->num_lanes = (this->num_candidates + kLaneWidth - 1) / kLaneWidth * kLaneWidth;
+        this->prior_in_region.resize(K);
+        this->prior_near.resize(K);
+        this->da.assign(this->num_lanes, 0.0);
+        this->acc.assign(this->num_lanes, 0.0);
+        this->vel0.assign(this->num_lanes, 0.0);
+        this->points.assign(this->num_lanes, 0.0);
+        this->cost.assign(this->num_lanes, 0.0);
+        this->valid.assign(this->num_lanes, 0);
+        this->step_words = (K + 63) / 64;
+        this->near_steps.assign((size_t)this->num_lanes * this->step_words, 0);
+        this->collision.assign(this->num_lanes, 0.0);
+        this->max_da = 0.0;
+        for (int i = 0; i < this->num_candidates; i++)
+        {
+            this->da[i] = this->config.Da(i);
+            this->max_da = std::max(this->max_da, this->da[i]);
+        }
+    }
+
+    MpcParams Params() const { return this->config.Params(); }
+
+    /* Evaluate all jerk candidates over the horizon and select the one with minimum cost.
+    *  \param[in]: ego The current position and velocity of the ego car
+    *  \param[in]: prior The current position, velocity and acceleration of the prior car
+    *  \param[in]: acc_cmd The acceleration command from the previous time step
+    *  \param[in]: yield The YIELD signal of the decision step
+    *  \param[in]: grid Optional occupancy of all cars, replaces the collision check against the prior car
+    *  \param[in]: samples Optional sampled trajectories of the crossing cars, replaces the near check
+    *               against the prior car and adds the collision probability to the cost, not with grid.
+    *               It brakes harder than the prior car check, so candidates that could not ramp the
+    *               acceleration back to 0 before the velocity drops below min_v are left out as well
+    *  \return: The chosen candidate, the first one if several have the same cost
+     */
+    MpcResult Solve(const EgoState& ego, const PriorCarState& prior, double acc_cmd, bool yield,
+                    const OccupancyGrid* grid = nullptr, const SampledPrediction* samples = nullptr)
+    {
+        PredictPrior(prior, samples);
+        PrepareCandidates(ego, acc_cmd, samples != nullptr);
+        for (int lane = 0; lane < this->num_lanes; lane += kLaneWidth)
+        {
+            EvaluateLanes(lane, ego, yield, grid, samples);
+        }
+        MpcResult result = { -1, acc_cmd, std::numeric_limits<double>::infinity() };
+        for (int i = 0; i < this->num_candidates; i++)
+        {
+            if (this->valid[i] && (result.index < 0 || this->cost[i] < result.cost))
+            {
+                result.index = i;
+                result.acc = this->acc[i];
+                result.cost = this->cost[i];
+            }
+        }
+        return result;
+    }
+
+    // Cost of candidate i after the last Solve, infinity if it violated the acceleration limits
+    double Cost(int i) const { return this->valid[i] ? this->cost[i] : std::numeric_limits<double>::infinity(); }
+
+    // Number of points in the obstacle region of candidate i after the last Solve
+    int Points(int i) const { return (int)this->points[i]; }
+
+    // Collision probability of candidate i after the last Solve with samples
+    double CollisionProbability(int i) const { return this->collision[i]; }
+
+private:
+#if defined(__AVX2__)
+    static const int kLaneWidth = 4;
+#else
+    static const int kLaneWidth = 1;
+#endif
+
+    /* Predict the prior car with constant acceleration, held where it stops, and flag the steps
+    *  in which it is in the obstacle region (between yield_line and the intersection) or near
+    *  the intersection.
+    *  With samples the near flag is the fraction of samples near the intersection.
+     */
+    void PredictPrior(const PriorCarState& prior, const SampledPrediction* samples)
+    {
+        for (int k = 0; k < this->config.K(); k++)
+        {
+            double pos = prior.pos + prior.vel*k*this->config.Dt() + 0.5*prior.acc*this->config.StepSq(k);
+            pos = HoldAtStop(prior, k*this->config.Dt(), pos);
+            this->prior_in_region[k] = (pos < 0 && pos > this->config.YieldLine()) ? 1.0 : 0.0;
+            this->prior_near[k] = samples ? samples->NearFraction(k) : ((std::abs(pos) < 5) ? 1.0 : 0.0);
+        }
+    }
+
+    // Flag step k for the collision probability of the candidate at lane
+    void MarkNear(int lane, int k)
+    {
+        this->near_steps[(size_t)lane * this->step_words + k / 64] |= 1ULL << (k % 64);
+    }
+
+    // Add the collision probability over the flagged steps to the cost of the lanes starting at lane
+    void AddCollisionCost(int lane, const SampledPrediction* samples)
+    {
+        for (int l = lane; l < lane + kLaneWidth; l++)
+        {
+            this->collision[l] = samples->CollisionProbability(&this->near_steps[(size_t)l * this->step_words]);
+            this->cost[l] += samples->Params().Cp * this->collision[l];
+        }
+    }
+
+    /* Set the acceleration, the initial velocity and the validity of every candidate lane.
+    *  \param[in]: ramp_to_stop If candidates that cannot ramp to a standstill are invalid, the
+    *               largest jerk is always kept since it brakes the least
+     */
+    void PrepareCandidates(const EgoState& ego, double acc_cmd, bool ramp_to_stop)
+    {
+        for (int i = 0; i < this->num_candidates; i++)
+        {
+            const float da_f = this->config.Da(i);
+            this->valid[i] = (acc_cmd + da_f <= this->config.MaxA() && acc_cmd + da_f >= this->config.MinA());
+            this->acc[i] = da_f + acc_cmd;
+            this->vel0[i] = ego.vel + da_f * this->config.Dt();
+            if (ramp_to_stop && this->valid[i] && this->da[i] < this->max_da && !CanRampToStop(ego.vel, this->acc[i]))
+            {
+                this->valid[i] = 0;
+            }
+        }
+    }
+
+    /* If the ego car can apply acc and then raise the acceleration to 0 with the largest jerk
+    *  before the velocity command drops below min_v. Planner::ApplyAcc clamps such a command to
+    *  min_v and zeroes the acceleration in one step, which breaks the jerk limit.
+     */
+    bool CanRampToStop(double vel, double acc) const
+    {
+        const double dt = this->config.Dt();
+        vel += acc*dt;
+        while (acc < 0 && vel >= this->config.MinV())
+        {
+            acc = std::min(0.0, acc + this->max_da);
+            vel += acc*dt;
+        }
+        return vel >= this->config.MinV();
+    }
+
+#if defined(__AVX2__)
+    // Evaluate the 4 candidates starting at lane over the whole horizon
+    void EvaluateLanes(int lane, const EgoState& ego, bool yield, const OccupancyGrid* grid, const SampledPrediction* samples)
+    {
+        const int K = this->config.K();
+        const __m256d pos0 = _mm256_set1_pd(ego.pos);
+        const __m256d vel_ego = _mm256_set1_pd(ego.vel);
+        const __m256d dt = _mm256_set1_pd(this->config.Dt());
+        const __m256d half = _mm256_set1_pd(0.5);
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d margin = _mm256_set1_pd(this->config.Margin());
+        const __m256d near = _mm256_set1_pd(5.0);
+        const __m256d ten = _mm256_set1_pd(10.0);
+        const __m256d sign = _mm256_set1_pd(-0.0);
+        const __m256d cv = _mm256_set1_pd(this->config.Cv());
+        const __m256d ca = _mm256_set1_pd(this->config.Ca());
+        const __m256d vel_target = _mm256_set1_pd(this->config.VelTarget());
+        const __m256d vel0 = _mm256_loadu_pd(&this->vel0[lane]);
+        const __m256d da = _mm256_loadu_pd(&this->da[lane]);
+        const __m256d acc = _mm256_loadu_pd(&this->acc[lane]);
+        const __m256d half_da = _mm256_mul_pd(half, da);
+
+        // Count the points in the obstacle region, 1 per step in the region and 10 per step near the prior car
+        if (samples)
+        {
+            std::fill_n(&this->near_steps[(size_t)lane * this->step_words], kLaneWidth * this->step_words, 0);
+        }
+        __m256d points = zero;
+        for (int k = 0; k < K; k++)
+        {
+            const __m256d kk = _mm256_set1_pd((double)k);
+            const __m256d pos = _mm256_add_pd(_mm256_add_pd(pos0, _mm256_mul_pd(_mm256_mul_pd(vel0, kk), dt)),
+                                              _mm256_mul_pd(half_da, _mm256_set1_pd(this->config.StepSq(k))));
+            const __m256d in_region = yield ? _mm256_cmp_pd(pos, margin, _CMP_GT_OQ) : _mm256_cmp_pd(pos, zero, _CMP_LT_OQ);
+            points = _mm256_add_pd(points, _mm256_and_pd(in_region, _mm256_set1_pd(this->prior_in_region[k])));
+            if (grid)
+            {
+                // The grid is a bitset lookup per lane, there is no gather for it
+                alignas(32) double lane_pos[kLaneWidth];
+                _mm256_store_pd(lane_pos, pos);
+                const __m256d hits = _mm256_set_pd(grid->Occupied(k, lane_pos[3]), grid->Occupied(k, lane_pos[2]),
+                                                   grid->Occupied(k, lane_pos[1]), grid->Occupied(k, lane_pos[0]));
+                points = _mm256_add_pd(points, _mm256_mul_pd(ten, hits));
+                continue;
+            }
+            const __m256d is_near = _mm256_cmp_pd(_mm256_andnot_pd(sign, pos), near, _CMP_LT_OQ);
+            points = _mm256_add_pd(points, _mm256_and_pd(is_near, _mm256_mul_pd(ten, _mm256_set1_pd(this->prior_near[k]))));
+            if (samples)
+            {
+                const int near_lanes = _mm256_movemask_pd(is_near);
+                for (int l = 0; l < kLaneWidth; l++) {if (near_lanes & (1 << l)) {MarkNear(lane + l, k);}}
+            }
+        }
+        _mm256_storeu_pd(&this->points[lane], points);
+
+        // Accumulate the cost in the same order as CalculateCost
+        const __m256d acc_term = _mm256_mul_pd(ca, _mm256_mul_pd(acc, acc));
+        const __m256d points_term = _mm256_mul_pd(points, points);
+        const __m256d acc_dt = _mm256_mul_pd(acc, dt);
+        __m256d cost = zero;
+        for (int k = 0; k < K; k++)
+        {
+            const __m256d vel = _mm256_add_pd(vel_ego, _mm256_mul_pd(acc_dt, _mm256_set1_pd((double)k)));
+            const __m256d dv = _mm256_sub_pd(vel_target, vel);
+            cost = _mm256_add_pd(cost, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(cv, _mm256_mul_pd(dv, dv)), acc_term), points_term));
+        }
+        _mm256_storeu_pd(&this->cost[lane], cost);
+        if (samples) {AddCollisionCost(lane, samples);}
+    }
+#else
+    // Evaluate the candidate at lane over the whole horizon
+    void EvaluateLanes(int lane, const EgoState& ego, bool yield, const OccupancyGrid* grid, const SampledPrediction* samples)
+    {
+        const int K = this->config.K();
+        const double dt = this->config.Dt();
+        const double vel0 = this->vel0[lane], half_da = 0.5*this->da[lane], acc = this->acc[lane];
+        if (samples) {std::fill_n(&this->near_steps[(size_t)lane * this->step_words], this->step_words, 0);}
+        double points = 0.0;
+        for (int k = 0; k < K; k++)
+        {
+            const double pos = ego.pos + vel0*(double)k*dt + half_da*this->config.StepSq(k);
+            const bool in_region = yield ? (pos > this->config.Margin()) : (pos < 0);
+            if (in_region && this->prior_in_region[k] != 0.0) {points += 1.0;}
+            if (grid)
+            {
+                if (grid->Occupied(k, pos)) {points += 10.0;}
+            }
+            else if (std::abs(pos) < 5)
+            {
+                // prior_near is 0 or 1 without samples, adding 0 leaves the points unchanged
+                points += 10.0*this->prior_near[k];
+                if (samples) {MarkNear(lane, k);}
+            }
+        }
+        this->points[lane] = points;
+
+        const double acc_term = this->config.Ca()*(acc*acc);
+        const double points_term = points*points;
+        double cost = 0.0;
+        for (int k = 0; k < K; k++)
+        {
+            const double dv = this->config.VelTarget() - (ego.vel + acc*dt*(double)k);
+            cost += this->config.Cv()*(dv*dv) + acc_term + points_term;
+        }
+        this->cost[lane] = cost;
+        if (samples) {AddCollisionCost(lane, samples);}
+    }
+#endif
+
+private:
+    const Config config;
+    int num_candidates;                             // Number of entries in da_list
+    int num_lanes;                                  // num_candidates rounded up to the SIMD width
+    std::vector<double> prior_in_region;            // 1 if the prior car is between yield_line and the intersection at step k
+    std::vector<double> prior_near;                 // 1 if the prior car is near the intersection at step k
+    std::vector<double> da;                         // Jerk of every candidate lane
+    double max_da;                                  // Largest jerk of da_list, the fastest ramp of the acceleration
+    std::vector<double> acc;                        // Acceleration of every candidate lane
+    std::vector<double> vel0;                       // Velocity after the first step of every candidate lane
+    std::vector<double> points;                     // Points in the obstacle region of every candidate lane
+    std::vector<double> cost;                       // Cost of every candidate lane
+    std::vector<char> valid;                        // If the candidate respects max_a and min_a, and can ramp to a stop with samples
+    int step_words;                                 // 64 bit words of step flags per lane
+    std::vector<uint64_t> near_steps;               // Steps in which every candidate lane is near the intersection
+    std::vector<double> collision;                  // Collision probability of every candidate lane
+};
+
+// The kernel with the parameters of an MpcParams
+typedef BasicMpcKernel<RuntimeMpcConfig> MpcKernel;
+
+#endif // MPC_KERNEL_H
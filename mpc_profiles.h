@@ -0,0 +1,133 @@
+#ifndef MPC_PROFILES_H
+#define MPC_PROFILES_H
+
+#include <array>
+#include "mpc_kernel.h"
+
+/**
+ * Planner profiles fixed at compile time. A profile lists the planner parameters as constants,
+ * FixedMpcKernel<Profile> evaluates the candidates with them, so the horizon length is a
+ * constant that the compiler can unroll and the (k*dt)^2 terms come from a table computed at
+ * compile time. The tables are computed with the same float and double operations as
+ * RuntimeMpcConfig, so a fixed kernel selects the same candidate as MpcKernel with the same
+ * parameters. MpcKernel stays the runtime configurable variant for experiments.
+ * Only C++11 constexpr is used, the table is built from a pack of the step numbers.
+ */
+
+// The parameters of the deployed planner, MpcDefaults are also the defaults of MpcParams
+struct DefaultProfile : MpcDefaults
+{
+};
+
+// The deployed planner looking twice as far ahead
+struct LongHorizonProfile : DefaultProfile
+{
+    static constexpr int K = 100;
+};
+
+// The step numbers 0 to K-1 of a horizon as a parameter pack
+template <int... k>
+struct StepSequence {};
+
+template <int K, int... k>
+struct MakeStepSequence : MakeStepSequence<K - 1, K - 1, k...> {};
+
+template <int... k>
+struct MakeStepSequence<0, k...>
+{
+    typedef StepSequence<k...> type;
+};
+
+// Horizon time terms of a profile, computed at compile time
+template <class Profile>
+struct HorizonTable
+{
+    double step_sq[Profile::K];                     // (k*dt)^2 for every step of the horizon
+
+    // k*dt is a float product like in RuntimeMpcConfig, its square is exact in double
+    static constexpr double StepSq(int k) { return (double)(float)(k*Profile::dt) * (double)(float)(k*Profile::dt); }
+
+    template <int... k>
+    static constexpr HorizonTable Make(StepSequence<k...>) { return {{ StepSq(k)... }}; }
+};
+
+/**
+ * Parameters of the kernel fixed by a profile, every accessor is a compile-time constant.
+ */
+template <class Profile>
+class ProfileMpcConfig {
+
+public:
+    static constexpr int K() { return Profile::K; }
+    static constexpr float Dt() { return Profile::dt; }
+    static constexpr double Cv() { return Profile::Cv; }
+    static constexpr double Ca() { return Profile::Ca; }
+    static constexpr double Margin() { return Profile::margin; }
+    static constexpr double VelTarget() { return Profile::vel_target; }
+    static constexpr double MaxA() { return Profile::max_a; }
+    static constexpr double MinA() { return Profile::min_a; }
+    static constexpr double MinV() { return Profile::min_v; }
+    static constexpr double YieldLine() { return Profile::yield_line; }
+    static constexpr int NumCandidates() { return (int)Profile::DaList().size(); }
+    static float Da(int i) { return Profile::DaList()[i]; }
+    static double StepSq(int k) { return kTable.step_sq[k]; }
+
+    // The profile in the form of runtime parameters
+    static MpcParams Params()
+    {
+        MpcParams params;
+        params.K = Profile::K;
+        params.Cv = Profile::Cv;
+        params.Ca = Profile::Ca;
+        params.margin = Profile::margin;
+        params.vel_target = Profile::vel_target;
+        params.max_a = Profile::max_a;
+        params.min_a = Profile::min_a;
+        params.max_v = Profile::max_v;
+        params.min_v = Profile::min_v;
+        const std::array<float, NumCandidates()> da_list = Profile::DaList();
+        params.da_list.assign(da_list.begin(), da_list.end());
+        params.dt = Profile::dt;
+        params.yield_line = Profile::yield_line;
+        return params;
+    }
+
+    // If the runtime parameters are exactly the ones of the profile
+    static bool Matches(const MpcParams& params)
+    {
+        const MpcParams profile = Params();
+        return params.K == profile.K && params.Cv == profile.Cv && params.Ca == profile.Ca &&
+               params.margin == profile.margin && params.vel_target == profile.vel_target &&
+               params.max_a == profile.max_a && params.min_a == profile.min_a &&
+               params.max_v == profile.max_v && params.min_v == profile.min_v &&
+               params.da_list == profile.da_list && params.dt == profile.dt && params.yield_line == profile.yield_line;
+    }
+
+private:
+    static constexpr HorizonTable<Profile> kTable = HorizonTable<Profile>::Make(typename MakeStepSequence<Profile::K>::type());
+};
+
+template <class Profile>
+constexpr HorizonTable<Profile> ProfileMpcConfig<Profile>::kTable;
+
+// The kernel compiled for the parameters of a profile
+template <class Profile>
+using FixedMpcKernel = BasicMpcKernel<ProfileMpcConfig<Profile>>;
+
+// The profiles compiled into the planner, Runtime if the parameters match none of them
+enum class KernelProfile
+{
+    Runtime,                                        // MpcKernel with the parameters read at run time
+    Default,                                        // FixedMpcKernel<DefaultProfile>
+    LongHorizon                                     // FixedMpcKernel<LongHorizonProfile>
+};
+
+// The fixed profile with exactly these parameters, if any
+inline KernelProfile MatchProfile(const MpcParams& params)
+{
+    if (ProfileMpcConfig<DefaultProfile>::Matches(params)) {return KernelProfile::Default;}
+    if (ProfileMpcConfig<LongHorizonProfile>::Matches(params)) {return KernelProfile::LongHorizon;}
+    return KernelProfile::Runtime;
+}
+
+#endif // MPC_PROFILES_H
@@ -0,0 +1,227 @@
+#ifndef OCCUPANCY_GRID_H
+#define OCCUPANCY_GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Space-time occupancy index of the ego car's path through the intersection. The path (the
+ * lane 0 corridor along the x axis) is cut into cells, and every cell holds a bitmask over the
+ * steps of the horizon marking when the centre of the ego car in that cell would overlap another
+ * car. The footprints of the other cars are grown by the half length of the ego car (Minkowski
+ * sum), so a candidate trajectory is checked against all cars with a single bit test per step,
+ * independent of the number of cars. A crossing car stays at the same x, so its entry and exit
+ * steps of the corridor are computed from its kinematics and ORed into a few cells at once; cars
+ * whose motion never touches the corridor are rejected in O(1). Building the grid therefore costs
+ * a few word operations per car and stays flat with hundreds of cars.
+ * A car braking to a standstill stays where it stops instead of reversing, like the prior car
+ * (HoldAtStop) and the samples of SampledPrediction, so a car stopped in the intersection keeps
+ * its cells blocked for the rest of the horizon.
+ */
+
+// Geometry of the grid, the defaults match the intersection of the simulator
+struct OccupancyParams
+{
+    double x_min = -60.0, x_max = 60.0;             // Extent of the ego path covered by the grid
+    double cell = 0.5;                              // Cell length in meters
+    double corridor_y = 2.0;                        // y of the ego lane
+    double car_length = 4.5, car_width = 2.0;       // Footprint of every car
+    double clearance = 0.5;                         // Extra distance kept to other cars
+};
+
+// Predicted motion of another car with constant acceleration until it stops
+struct VehiclePrediction
+{
+    double x, y;
+    double vx, vy;
+    double ax, ay;
+    bool along_x;                                   // If the car drives along the x axis (lanes 0 and 2)
+};
+
+class OccupancyGrid {
+
+public:
+    /* Constructor
+    *  \param[in]: K Number of steps for prediction horizon
+    *  \param[in]: dt Time step in seconds
+    *  \param[in]: params The geometry of the grid
+     */
+    OccupancyGrid(int K, float dt, const OccupancyParams& params = OccupancyParams())
+        : K(K), dt(dt), params(params)
+    {
+        this->num_cells = (int)std::ceil((params.x_max - params.x_min) / params.cell);
+        this->inv_cell = 1.0 / params.cell;
+        this->words_per_cell = (K + 63) / 64;
+        this->bits.assign((size_t)this->num_cells * this->words_per_cell, 0);
+        this->step_mask.assign(this->words_per_cell, 0);
+        this->dirty_first = this->num_cells;
+        this->dirty_last = -1;
+    }
+
+    // Remove all cars, only the cells that were marked are cleared
+    void Clear()
+    {
+        if (this->dirty_first <= this->dirty_last)
+        {
+            std::fill(this->bits.begin() + (size_t)this->dirty_first * this->words_per_cell,
+                      this->bits.begin() + (size_t)(this->dirty_last + 1) * this->words_per_cell, 0);
+        }
+        this->dirty_first = this->num_cells;
+        this->dirty_last = -1;
+        this->num_inserted = 0;
+    }
+
+    /* Predict a car over the horizon and mark the cells it blocks for the ego car.
+    *  \param[in]: vehicle The current state of the car
+    *  \return: true if the car touches the ego path within the horizon
+     */
+    bool Insert(const VehiclePrediction& vehicle)
+    {
+        const double half_x = 0.5 * (vehicle.along_x ? this->params.car_length : this->params.car_width);
+        const double half_y = 0.5 * (vehicle.along_x ? this->params.car_width : this->params.car_length);
+        // Band of y in which the car overlaps the ego lane
+        const double reach_y = half_y + 0.5 * this->params.car_width + this->params.clearance;
+        const double band_lo = this->params.corridor_y - reach_y, band_hi = this->params.corridor_y + reach_y;
+        const double horizon = (this->K - 1) * (double)this->dt;
+        double y_lo, y_hi;
+        Range(vehicle.y, vehicle.vy, vehicle.ay, horizon, y_lo, y_hi);
+        if (y_hi < band_lo || y_lo > band_hi) {return false;}
+
+        // Grow the footprint by the half length of the ego car, so the ego car is a point on the grid
+        const double reach_x = half_x + 0.5 * this->params.car_length + this->params.clearance;
+        bool touched = false;
+        if (vehicle.vx == 0.0 && vehicle.ax == 0.0)
+        {
+            // Crossing car, the same cells are blocked from its entry to its exit of the corridor
+            std::fill(this->step_mask.begin(), this->step_mask.end(), 0);
+            if (vehicle.ay == 0.0)
+            {
+                int k_first, k_last;
+                if (!StepsInBand(vehicle.y, vehicle.vy, band_lo, band_hi, k_first, k_last)) {return false;}
+                for (int k = k_first; k <= k_last; k++) {this->step_mask[k >> 6] |= 1ULL << (k & 63);}
+            }
+            else
+            {
+                for (int k = 0; k < this->K; k++)
+                {
+                    const double t = k * (double)this->dt;
+                    const double y = StoppingPos(vehicle.y, vehicle.vy, vehicle.ay, t);
+                    if (y >= band_lo && y <= band_hi) {this->step_mask[k >> 6] |= 1ULL << (k & 63);}
+                }
+            }
+            touched = MarkCells(vehicle.x - reach_x, vehicle.x + reach_x, &this->step_mask[0]);
+        }
+        else
+        {
+            // Car moving along the corridor, the blocked cells move with it
+            for (int k = 0; k < this->K; k++)
+            {
+                const double t = k * (double)this->dt;
+                const double y = StoppingPos(vehicle.y, vehicle.vy, vehicle.ay, t);
+                if (y < band_lo || y > band_hi) {continue;}
+                const double x = StoppingPos(vehicle.x, vehicle.vx, vehicle.ax, t);
+                std::fill(this->step_mask.begin(), this->step_mask.end(), 0);
+                this->step_mask[k >> 6] = 1ULL << (k & 63);
+                touched |= MarkCells(x - reach_x, x + reach_x, &this->step_mask[0]);
+            }
+        }
+        this->num_inserted += touched ? 1 : 0;
+        return touched;
+    }
+
+    /* Check if the ego car at position x along its lane overlaps another car at step k.
+    *  Positions outside of the grid are always free.
+     */
+    bool Occupied(int k, double x) const
+    {
+        const double c = (x - this->params.x_min) * this->inv_cell;
+        if (!(c >= this->dirty_first && c < this->dirty_last + 1)) {return false;}
+        const int cell = (int)c;
+        return (this->bits[(size_t)cell * this->words_per_cell + (k >> 6)] >> (k & 63)) & 1;
+    }
+
+    int Steps() const { return this->K; }
+
+    // Number of cars that touch the ego path since the last Clear
+    int Inserted() const { return this->num_inserted; }
+
+private:
+    /* Position p + v*t + 0.5*a*t^2 along one axis. A car braking against its velocity stops
+    *  instead of reversing: once v + a*t changes sign it stays at p - v^2/(2a).
+     */
+    static double StoppingPos(double p, double v, double a, double t)
+    {
+        if (v * a < 0 && (v + a * t) * v <= 0) {return p - 0.5 * v * v / a;}
+        return p + v * t + 0.5 * a * t * t;
+    }
+
+    // Range of StoppingPos for t in [0, horizon]
+    static void Range(double p, double v, double a, double horizon, double& lo, double& hi)
+    {
+        const double end = StoppingPos(p, v, a, horizon);
+        lo = std::min(p, end);
+        hi = std::max(p, end);
+        if (a != 0.0)
+        {
+            const double t = -v / a;
+            if (t > 0 && t < horizon)
+            {
+                const double extremum = p + v * t + 0.5 * a * t * t;
+                lo = std::min(lo, extremum);
+                hi = std::max(hi, extremum);
+            }
+        }
+    }
+
+    // Steps in which y + v*k*dt is within [lo, hi], false if there are none in the horizon
+    bool StepsInBand(double y, double v, double lo, double hi, int& k_first, int& k_last) const
+    {
+        const double dt = this->dt;
+        if (v == 0.0)
+        {
+            if (y < lo || y > hi) {return false;}
+            k_first = 0;
+            k_last = this->K - 1;
+            return true;
+        }
+        double t_in = (lo - y) / v, t_out = (hi - y) / v;
+        if (t_in > t_out) {std::swap(t_in, t_out);}
+        k_first = std::max(0, (int)std::ceil(t_in / dt - 1e-9));
+        k_last = std::min(this->K - 1, (int)std::floor(t_out / dt + 1e-9));
+        return k_first <= k_last;
+    }
+
+    // OR the step mask into the cells overlapping [x_lo, x_hi]
+    bool MarkCells(double x_lo, double x_hi, const uint64_t* mask)
+    {
+        int first = (int)std::floor((x_lo - this->params.x_min) / this->params.cell);
+        int last = (int)std::floor((x_hi - this->params.x_min) / this->params.cell);
+        first = std::max(first, 0);
+        last = std::min(last, this->num_cells - 1);
+        if (first > last) {return false;}
+        for (int cell = first; cell <= last; cell++)
+        {
+            uint64_t* column = &this->bits[(size_t)cell * this->words_per_cell];
+            for (int w = 0; w < this->words_per_cell; w++) {column[w] |= mask[w];}
+        }
+        this->dirty_first = std::min(this->dirty_first, first);
+        this->dirty_last = std::max(this->dirty_last, last);
+        return true;
+    }
+
+private:
+    const int K;                                    // Number of steps for prediction horizon
+    const float dt;                                 // Time step in seconds
+    const OccupancyParams params;
+    int num_cells;                                  // Cells along the ego path
+    double inv_cell;                                // 1 / cell
+    int words_per_cell;                             // 64 bit words of step bits per cell
+    std::vector<uint64_t> bits;                     // Step bits of every cell
+    std::vector<uint64_t> step_mask;                // Scratch step bits of the car being inserted
+    int dirty_first, dirty_last;                    // Range of cells with bits set
+    int num_inserted = 0;
+};
+
+#endif // OCCUPANCY_GRID_H
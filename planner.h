@@ -0,0 +1,575 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "custom_messages.pb.h"
+#include "event_log.h"
+#include "analytic_kernel.h"
+#include "jerk_search.h"
+#include "latency_trace.h"
+#include "mpc_kernel.h"
+#include "mpc_profiles.h"
+#include "qp_solver.h"
+#include "vehicle_tracker.h"
+
+#define ApplyEBrake false   //If true, apply emergency brake to strictly follow right hand rule
+
+// How the planner evaluates the acceleration candidates
+enum class PlannerMode
+{
+    Reference,                                      // Scalar PredictEgocarAcc, CalculateCost and SetVel on the message
+    Kernel,                                         // Vectorized MpcKernel on plain states, same selection as Reference
+    JerkSearch,                                     // Branch and bound over jerk sequences, see jerk_search.h
+    Qp,                                             // One acceleration per step from a QP, see qp_solver.h
+    Analytic                                        // Closed-form time windows instead of the K steps, see analytic_kernel.h
+};
+
+// Which cars the collision check of the candidates looks at
+enum class ConflictModel
+{
+    PriorCar,                                       // Only the prior car chosen by SetPriorCar
+    Occupancy,                                      // Every detected car on all lanes, through an OccupancyGrid
+    Sampled                                         // Sampled trajectories of the lane 1 cars, through a SampledPrediction
+};
+
+/**
+ * MPC planner for the ego vehicle. It only depends on the world state message, so it can
+ * be driven by the Gazebo client (client.cpp) as well as by the in-process simulator
+ * (world_sim.h) without any transport in between.
+ */
+class Planner {
+
+public:
+    static const int kPriorCarCapacity = 64;        // Cars on lane 1 the prior car lists hold without growing
+
+    /* Constructor
+    *  Initialize the vectors priorcar_predicted_pos and egocar_predicted_pos with size of K
+    *  Initialize priorcar_pos, priorcar_vel, priorcar_acc, acc_cmd and da_cmd
+    *  Reserve the candidate lists for da_list and the prior car lists for kPriorCarCapacity cars
+    *  \param[in]: mode How the acceleration candidates are evaluated
+    *  \param[in]: pool Optional thread pool for the JerkSearch mode and the sampled prediction, not owned
+    *  \param[in]: params The cost weights, decision thresholds, limits and jerk candidates
+    *  \param[in]: qp_params The jerk weight and the ADMM settings of the Qp mode
+    */
+    explicit Planner(PlannerMode mode = PlannerMode::Kernel, ThreadPool* pool = nullptr, const MpcParams& params = MpcParams(),
+                     const QpParams& qp_params = QpParams())
+        : mode(mode), K(params.K), Cv(params.Cv), Ca(params.Ca), margin(params.margin), vel_target(params.vel_target),
+          max_a(params.max_a), min_a(params.min_a), max_v(params.max_v), min_v(params.min_v), da_list(params.da_list),
+          dt(params.dt), yield_line(params.yield_line),
+          kernel(KernelParams()), search(KernelParams(), SearchParams(), pool), grid(K, dt), sampled(K, dt, SampleParams(), pool),
+          tracker(dt), qp(KernelParams(), qp_params), analytic(KernelParams())
+    {
+        this->profile = MatchProfile(KernelParams());
+        this->priorcar_predicted_pos.resize(this->K);
+        this->egocar_predicted_pos.resize(this->K);
+        // Reserve all lists up front, so a tick does not allocate once they reached their size
+        this->acc_list.reserve(this->da_list.size());
+        this->point_in_region_list.reserve(this->da_list.size());
+        this->cost_list.reserve(this->da_list.size());
+        this->priorcar_surpass_pos_list.reserve(kPriorCarCapacity);
+        this->priorcar_yield_pos_list.reserve(kPriorCarCapacity);
+        this->priorcar_surpass_vel_list.reserve(kPriorCarCapacity);
+        this->priorcar_yield_vel_list.reserve(kPriorCarCapacity);
+        this->priorcar_surpass_acc_list.reserve(kPriorCarCapacity);
+        this->priorcar_yield_acc_list.reserve(kPriorCarCapacity);
+        Reset();
+    }
+
+    // Called when a new simulation round starts, the ego car starts over without any acceleration
+    void Reset()
+    {
+        this->priorcar_pos = 50.0;
+        this->priorcar_vel = 0.0;
+        this->priorcar_acc = 0.0;
+        this->vel_cmd = 0.0;
+        this->acc_cmd = 0.0;
+        this->da_cmd = 0.0;
+        this->points_in_region = 0;
+        this->tracker.Clear();
+        this->qp.Reset();
+    }
+
+    /* Run one planning step on the received world state.
+    *  \param[in]: msg The states of the ego car and all other cars
+    *  \return: The velocity command for the next time step
+    */
+    double Plan(const custom_messages::WorldState& msg)
+    {
+        // Calculate the next velocity for the ego car.
+        {
+            TRACE_SCOPE(SetPriorCar);
+            SetPriorCar(msg);
+        }
+        // Log the state and commands at the debug level
+        LOG_EVENT(Debug, PriorCar, this->priorcar_pos, this->priorcar_vel, this->priorcar_acc);
+        LOG_EVENT(Debug, EgoCar, msg.ego_vehicle().position().x(), msg.ego_vehicle().velocity().x());
+        // Make action decision according to ego car position and prior car states, either yield or surpass the prior car.
+        {
+            TRACE_SCOPE(MakeDecision);
+            MakeDecision(msg);
+        }
+        if (this->mode != PlannerMode::Reference)
+        {
+            // Evaluate all acceleration candidates at once and set the velocity with the cheapest one
+            MpcResult result;
+            {
+                TRACE_SCOPE(PredictEgocarAcc);
+                const OccupancyGrid* conflicts = nullptr;
+                const SampledPrediction* samples = nullptr;
+                if (this->conflict == ConflictModel::Occupancy)
+                {
+                    BuildOccupancy(msg);
+                    conflicts = &this->grid;
+                }
+                else if (this->conflict == ConflictModel::Sampled && this->mode == PlannerMode::Kernel)
+                {
+                    BuildSamples(msg);
+                    samples = &this->sampled;
+                }
+                EgoState ego = { msg.ego_vehicle().position().x(), msg.ego_vehicle().velocity().x() };
+                PriorCarState prior = { this->priorcar_pos, this->priorcar_vel, this->priorcar_acc };
+                if (this->mode == PlannerMode::JerkSearch)
+                {
+                    // Search jerk sequences over the horizon and apply the first step of the best one
+                    result = this->search.Solve(ego, prior, this->acc_cmd, this->YIELD, conflicts);
+                }
+                else if (this->mode == PlannerMode::Qp)
+                {
+                    // Solve for one acceleration per step and apply the first one, the QP only looks at the prior car
+                    result = this->qp.Solve(ego, prior, this->acc_cmd, this->YIELD);
+                }
+                else if (this->mode == PlannerMode::Analytic)
+                {
+                    // Score the candidates with the time windows of the prior car, in O(1) per candidate
+                    result = this->analytic.Solve(ego, prior, this->acc_cmd, this->YIELD);
+                }
+                else
+                {
+                    result = SolveKernel(ego, prior, conflicts, samples);
+                }
+            }
+            TRACE_SCOPE(SetVel);
+            ApplyAcc(msg, result.acc);
+            return this->vel_cmd;
+        }
+        // Predict ego car's future acceleration list.
+        {
+            TRACE_SCOPE(PredictEgocarAcc);
+            PredictEgocarAcc(msg);
+        }
+        // Calculate the cost according to the acceleration list
+        {
+            TRACE_SCOPE(CalculateCost);
+            CalculateCost(msg);
+        }
+        // Set velocity according to the cost list
+        TRACE_SCOPE(SetVel);
+        SetVel(msg);
+        return this->vel_cmd;
+    }
+
+    double VelCmd() const { return this->vel_cmd; }
+    double AccCmd() const { return this->acc_cmd; }
+    PlannerMode Mode() const { return this->mode; }
+    JerkSearch& Search() { return this->search; }
+    SampledPrediction& Sampler() { return this->sampled; }
+    const QpSolver& Qp() const { return this->qp; }
+    const VehicleTracker& Tracker() const { return this->tracker; }
+
+    /* Select the collision check of the Kernel and JerkSearch modes, the Reference, Qp and Analytic modes always
+    *  use the prior car. The sampled prediction is only scored by the Kernel mode.
+     */
+    void SetConflictModel(ConflictModel conflict) { this->conflict = conflict; }
+    ConflictModel Conflict() const { return this->conflict; }
+
+    /* Select the kernel of the Kernel mode. A fixed profile is only taken if the parameters of the
+    *  planner are exactly the ones of the profile, otherwise the runtime kernel is used.
+     */
+    void SetKernelProfile(KernelProfile profile)
+    {
+        this->profile = (profile == MatchProfile(KernelParams())) ? profile : KernelProfile::Runtime;
+    }
+    KernelProfile Profile() const { return this->profile; }
+
+    // The parameters of this planner in the form of the planning kernel
+    MpcParams KernelParams() const
+    {
+        MpcParams params;
+        params.K = this->K;
+        params.Cv = this->Cv;
+        params.Ca = this->Ca;
+        params.margin = this->margin;
+        params.vel_target = this->vel_target;
+        params.max_a = this->max_a;
+        params.min_a = this->min_a;
+        params.max_v = this->max_v;
+        params.min_v = this->min_v;
+        params.da_list = this->da_list;
+        params.dt = this->dt;
+        params.yield_line = this->yield_line;
+        return params;
+    }
+
+private:
+    friend class PlannerBench;                      // Drives the stages one by one, see planner_bench.cpp
+
+    // Reset all the lists of prior cars
+    void ResetPriorCarList()
+    {
+        this->priorcar_yield_pos_list.clear();
+        this->priorcar_yield_vel_list.clear();
+        this->priorcar_surpass_pos_list.clear();
+        this->priorcar_surpass_vel_list.clear();
+        this->priorcar_yield_acc_list.clear();
+        this->priorcar_surpass_acc_list.clear();
+    }
+
+    /* Set the prior car position, velocity and acceleration according all the received car states
+    *  First update the tracker with the received car states, it estimates the accelerations.
+    *  Then check if there are cars on the right of the ego car, if so then categorize them
+    *  in priorcar_yield_pos_list and priorcar_surpass_pos_list according to yield_line.
+    *  The first car in the priorcar_surpass_pos_list is the prior car but can be surpassed.
+    *  The last car in the priorcar_yield_pos_list is the prior car but need to be yielded.
+    *  If both priorcar_yield_pos_list and priorcar_surpass_pos_list have cars, then check
+    *  the distance between the last car of priorcar_yield_pos_list and the first car of
+    *  priorcar_surpass_pos_list, if distance is less than yield_line, then make the car in
+    *  priorcar_surpass_pos_list the prior car.
+    *  \param[in/out]: priorcar_pos
+    *                  priorcar_vel
+    *                  priorcar_acc
+    *  \param[in]: msg The states of all other cars
+    *  \param[in]: yield_line The threshold for categorizing prior cars
+     */
+    void SetPriorCar(const custom_messages::WorldState& msg)
+    {
+        // Reset all the lists
+        ResetPriorCarList();
+        this->tracker.Update(msg);
+        // Read states of all cars
+        for (const auto& vehicle_msg : msg.vehicles())
+        {
+            // If cars show up on lane 1 and on the right,
+            if (vehicle_msg.lane_id() == 1 && vehicle_msg.position().y() < 0)
+            {
+                double ax, ay;
+                this->tracker.Acceleration(vehicle_msg.vehicle_id(), ax, ay);
+                // then catagorize them according to yield_line.
+                if (vehicle_msg.position().y() > this->yield_line)
+                {
+                    this->priorcar_yield_pos_list.push_back(vehicle_msg.position().y());
+                    this->priorcar_yield_vel_list.push_back(vehicle_msg.velocity().y());
+                    this->priorcar_yield_acc_list.push_back(ay);
+                }
+                else
+                {
+                    this->priorcar_surpass_pos_list.push_back(vehicle_msg.position().y());
+                    this->priorcar_surpass_vel_list.push_back(vehicle_msg.velocity().y());
+                    this->priorcar_surpass_acc_list.push_back(ay);
+                }
+            }
+        }
+        // If there is any prior car on the right side
+        if (this->priorcar_yield_pos_list.size() > 0 || this->priorcar_surpass_pos_list.size() > 0)
+        {
+            //If both priorcar_yield_pos_list and priorcar_surpass_pos_list have cars
+            if(this->priorcar_yield_pos_list.size() > 0 && this->priorcar_surpass_pos_list.size() > 0)
+            {
+            /*Check the distance between the last car of priorcar_yield_pos_list and the first car of
+            *  priorcar_surpass_pos_list, if distance is less than yield_line, then make the car in
+            *  priorcar_surpass_pos_list the prior car.
+            */
+                int priorCarYieldIndex = std::min_element(this->priorcar_yield_pos_list.begin(),this->priorcar_yield_pos_list.end()) - this->priorcar_yield_pos_list.begin();
+                int priorCarSurpassIndex = std::max_element(this->priorcar_surpass_pos_list.begin(),this->priorcar_surpass_pos_list.end()) - this->priorcar_surpass_pos_list.begin();
+                if(this->priorcar_surpass_pos_list[priorCarSurpassIndex] - this->priorcar_yield_pos_list[priorCarYieldIndex] > this->yield_line)
+                {
+                    this->priorcar_pos = this->priorcar_surpass_pos_list[priorCarSurpassIndex];
+                    this->priorcar_vel = this->priorcar_surpass_vel_list[priorCarSurpassIndex];
+                    this->priorcar_acc = this->priorcar_surpass_acc_list[priorCarSurpassIndex];
+                }
+                else
+                {
+                    this->priorcar_pos = this->priorcar_yield_pos_list[priorCarYieldIndex];
+                    this->priorcar_vel = this->priorcar_yield_vel_list[priorCarYieldIndex];
+                    this->priorcar_acc = this->priorcar_yield_acc_list[priorCarYieldIndex];
+                }
+            }
+            //If only priorcar_yield_pos_listst has cars, then the last car is the prior car.
+            else if(this->priorcar_yield_pos_list.size() > 0 && this->priorcar_surpass_pos_list.size() == 0)
+            {
+                int priorCarYieldIndex = std::min_element(this->priorcar_yield_pos_list.begin(),this->priorcar_yield_pos_list.end()) - this->priorcar_yield_pos_list.begin();
+                this->priorcar_pos = this->priorcar_yield_pos_list[priorCarYieldIndex];
+                this->priorcar_vel = this->priorcar_yield_vel_list[priorCarYieldIndex];
+                this->priorcar_acc = this->priorcar_yield_acc_list[priorCarYieldIndex];
+            }
+            //If only priorcar_surpass_pos_list has cars, then the first car is the prior car.
+            else
+            {
+                int priorCarSurpassIndex = std::max_element(this->priorcar_surpass_pos_list.begin(),this->priorcar_surpass_pos_list.end()) - this->priorcar_surpass_pos_list.begin();
+                this->priorcar_pos = this->priorcar_surpass_pos_list[priorCarSurpassIndex];
+                this->priorcar_vel = this->priorcar_surpass_vel_list[priorCarSurpassIndex];
+                this->priorcar_acc = this->priorcar_surpass_acc_list[priorCarSurpassIndex];
+            }
+        }
+        //If no cars on the right, then reinitialize priorcar_pos, priorcar_vel and priorcar_acc
+        else
+        {
+            this->priorcar_pos = 50.0;
+            this->priorcar_vel = this->max_v;
+            this->priorcar_acc = 0.0;
+        }
+    }
+
+    /* Predict every detected car on all lanes over the horizon into the occupancy grid, with the
+    *  accelerations estimated by the tracker in SetPriorCar.
+    *  The right of way is still decided by SetPriorCar and MakeDecision, the grid only
+    *  tells where the ego car would touch another car.
+    *  \param[in/out]: grid
+    *  \param[in]: msg The states of all other cars
+     */
+    void BuildOccupancy(const custom_messages::WorldState& msg)
+    {
+        this->grid.Clear();
+        for (const auto& vehicle_msg : msg.vehicles())
+        {
+            VehiclePrediction vehicle;
+            vehicle.x = vehicle_msg.position().x();
+            vehicle.y = vehicle_msg.position().y();
+            vehicle.vx = vehicle_msg.velocity().x();
+            vehicle.vy = vehicle_msg.velocity().y();
+            this->tracker.Acceleration(vehicle_msg.vehicle_id(), vehicle.ax, vehicle.ay);
+            vehicle.along_x = (vehicle_msg.lane_id() == 0 || vehicle_msg.lane_id() == 2);
+            this->grid.Insert(vehicle);
+        }
+    }
+
+    /* Sample the lane 1 cars that have not left the intersection yet, with the accelerations
+    *  estimated by the tracker in SetPriorCar. The samples of a tick only depend on the round
+    *  and the simulation time, so a replay sees the same ones.
+    *  \param[in/out]: sampled
+    *  \param[in]: msg The states of all other cars
+     */
+    void BuildSamples(const custom_messages::WorldState& msg)
+    {
+        this->sampled.Clear();
+        for (const auto& vehicle_msg : msg.vehicles())
+        {
+            if (vehicle_msg.lane_id() == 1 && vehicle_msg.position().y() < this->sampled.Params().near)
+            {
+                double ax, ay;
+                this->tracker.Acceleration(vehicle_msg.vehicle_id(), ax, ay);
+                this->sampled.Add(vehicle_msg.position().y(), vehicle_msg.velocity().y(), ay);
+            }
+        }
+        const uint64_t nanoseconds = (uint64_t)msg.time().sec() * 1000000000ULL + (uint64_t)msg.time().nsec();
+        this->sampled.Sample(((uint64_t)(uint32_t)msg.simulation_round() << 40) ^ nanoseconds);
+    }
+
+    // Evaluate the candidates with the kernel of the selected profile
+    MpcResult SolveKernel(const EgoState& ego, const PriorCarState& prior, const OccupancyGrid* conflicts,
+                          const SampledPrediction* samples)
+    {
+        switch (this->profile)
+        {
+            case KernelProfile::Default:
+                return this->default_kernel.Solve(ego, prior, this->acc_cmd, this->YIELD, conflicts, samples);
+            case KernelProfile::LongHorizon:
+                return this->long_horizon_kernel.Solve(ego, prior, this->acc_cmd, this->YIELD, conflicts, samples);
+            default:
+                return this->kernel.Solve(ego, prior, this->acc_cmd, this->YIELD, conflicts, samples);
+        }
+    }
+
+    /* Make action decision according to ego car position and prior car states, either yield or surpass the prior car.
+    *  \param[in/out]: YIELD
+    *  \param[in]: msg The position of the ego car
+    *  \param[in]: yield_line
+    *  \param[in]: priorcar_pos
+     */
+    void MakeDecision(const custom_messages::WorldState& msg)
+    {
+        this->YIELD  = false;
+        //If the prior car crosses the yield_line, then apply yield action.
+        if(this->priorcar_pos > this->yield_line && msg.ego_vehicle().position().x() < 0){this->YIELD  = true; LOG_EVENT(Debug, Yield, this->priorcar_pos, msg.ego_vehicle().position().x());}
+        //Backup line if(this->priorcar_pos > this->yield_line && msg.ego_vehicle().position().x() < margin){this->YIELD  = true; LOG_EVENT(Debug, Yield, this->priorcar_pos, msg.ego_vehicle().position().x());}
+    }
+
+    /* Predict a car's future positions with constant acceleration in K steps.
+    *  \param[in/out]: vector predicted_pos
+    *  \param[in]: current_pos - The current position of the car.
+    *  \param[in]: current_vel - The current velocity of the car.
+    *  \param[in]: current_acc - The current acceleration of the car.
+     */
+    void PredictPosWithConstAcc(std::vector<double>& predicted_pos, const double current_pos, const double current_vel, const double current_acc)
+    {
+        for (int k = 0; k < this->K; k++)
+        {
+            // Formula : Xt+dt = Xt + Vt * dt + 1/2 * At * dt^2
+            predicted_pos[k] = current_pos + current_vel*k*this->dt + 0.5*current_acc*std::pow(k*this->dt,2);
+        }
+    }
+
+    /* Predict ego car's future acceleration list according to the ego car's current and predicted positions,
+    *  prior car predicted positions and YIELD signal.
+    *  \param[in/out]: vector acc_list
+    *  \param[in]: ego_vehicle().position().x() - The current position of ego car.
+    *  \param[in]: egocar_predicted_pos - The predicted positions of the ego car.
+    *  \param[in]: priorcar_predicted_pos - The predicted positions of the prior car.
+    *  \param[in]: acc_cmd - acceleration command from previous time step.
+    */
+    void PredictEgocarAcc(const custom_messages::WorldState& msg)
+    {
+        // Predict the future positions of the prior car, if it brakes to a standstill it stays there
+        PredictPosWithConstAcc(this->priorcar_predicted_pos, this->priorcar_pos, this->priorcar_vel, this->priorcar_acc);
+        const PriorCarState prior = { this->priorcar_pos, this->priorcar_vel, this->priorcar_acc };
+        for (int k = 0; k < this->K; k++)
+        {
+            this->priorcar_predicted_pos[k] = HoldAtStop(prior, k*this->dt, this->priorcar_predicted_pos[k]);
+        }
+        // Initialize acc_list
+        this->acc_list.clear();
+        this->point_in_region_list.clear();
+        // Add each element of da_list to previous acc_cmd
+        for(std::vector<float>::const_iterator it = this->da_list.begin(); it != this->da_list.end(); ++it)
+        {
+            this->points_in_region = 0;
+            // Limit acc_cmd with max_a and min_a
+            if (this->acc_cmd + *it <= this->max_a && this->acc_cmd + *it >= this->min_a)
+            {
+                // Only take consideration of YIELD signal when the ego car hasnt passed the intersection
+                // Calculate the next velocity
+                double ego_vel_temp = msg.ego_vehicle().velocity().x() + (*it) * this->dt;
+
+                // Predict the future positions of the ego car with this acc_cmd
+                PredictPosWithConstAcc(this->egocar_predicted_pos, msg.ego_vehicle().position().x(), ego_vel_temp, *it);
+                for (int k = this->K - 1; k >= 0; k--)
+                {
+                    //If the position at k point is in the obstacle region, penalize it.
+                    //If ego car needs to yield, it should wait for the prior car to pass.
+                    if(this->YIELD)
+                    {
+                        if(this->egocar_predicted_pos[k] > margin && this->priorcar_predicted_pos[k] < 0 && this->priorcar_predicted_pos[k] > this->yield_line)
+                        {this->points_in_region += 1;}
+                    }
+                    //If ego car can surpass, it should pass as soon as possbile before prior car crosses yield line.
+                    else
+                    {
+                        if(this->egocar_predicted_pos[k] < 0 && this->priorcar_predicted_pos[k] < 0 && this->priorcar_predicted_pos[k] > this->yield_line)
+                        {this->points_in_region += 1;}
+                    }
+                    //If there is collision risk, penalize it with 10 points.
+                    if(std::abs(this->egocar_predicted_pos[k]) < 5 && std::abs(this->priorcar_predicted_pos[k]) < 5)
+                    {this->points_in_region += 10;}
+                }
+                this->acc_list.push_back(*it + this->acc_cmd);
+                this->point_in_region_list.push_back(this->points_in_region);
+            }
+        }
+    }
+
+    /* Calculate the costs and store the calculated cost according to valid acc_cmds.
+    *  Formula : Cv(vel_target - vel_next)^2 + Ca(acc^2) + (number of points that in the obstacle region)^2
+    *  \param[in/out]: vector cost_list
+    *  \param[in]: vel_target - The target velocity of ego car.
+    *  \param[in]: vel_next - The next possible velocity of ego car.
+    *  \param[in]: acc_list - The valid accelerations.
+     */
+    void CalculateCost(const custom_messages::WorldState& msg)
+    {
+        // Initialize cost_list
+        this->cost_list.clear();
+        // Loop over each valid acceleration in K steps and store the calculated cost in cost_list
+        for(size_t i = 0; i < this->acc_list.size(); i++)
+        {
+            // Initialize a temp cost value
+            double cost_temp = 0;
+            for(int k = 0; k < this->K; k++)
+            {
+                double vel_temp = msg.ego_vehicle().velocity().x() + this->acc_list[i] * this->dt * k;
+                cost_temp += this->Cv*std::pow(this->vel_target - vel_temp, 2) + Ca*std::pow(this->acc_list[i], 2) + std::pow(this->point_in_region_list[i], 2);
+            }
+            this->cost_list.push_back(cost_temp);
+
+        }
+    }
+
+    /* Set the velocity according to the minimum cost while keep acc_cmd and vel_cmd under constraints.
+    *  \param[in/out]: acc_cmd
+    *  \param[in/out]: vel_cmd
+    *  \param[in]: vector cost_list
+    *  \param[in]: vector acc_list
+     */
+    void SetVel(const custom_messages::WorldState& msg)
+    {
+        //Set the acceleration that has the minimum cost and keep it in constraints
+
+        int minCostIndex = std::min_element(this->cost_list.begin(),this->cost_list.end()) - this->cost_list.begin();
+        ApplyAcc(msg, this->acc_list[minCostIndex]);
+    }
+
+    /* Apply the selected acceleration and set the velocity while keep acc_cmd and vel_cmd under constraints.
+    *  \param[in/out]: acc_cmd
+    *  \param[in/out]: vel_cmd
+    *  \param[in]: acc The selected acceleration
+     */
+    void ApplyAcc(const custom_messages::WorldState& msg, double acc)
+    {
+        this->da_cmd = acc - this->acc_cmd;
+        this->acc_cmd = acc;
+        if (this->acc_cmd > this->max_a){this->acc_cmd = this->max_a;}
+        if (this->acc_cmd < this->min_a){this->acc_cmd = this->min_a;}
+
+        //Set the velocity according to the selected acceleration and keep it in constraints
+        this->vel_cmd = msg.ego_vehicle().velocity().x() + this->acc_cmd * this->dt;
+        if (this->vel_cmd > this->max_v){this->vel_cmd = this->max_v; this->acc_cmd = 0.0;}
+        if (this->vel_cmd < this->min_v){this->vel_cmd = this->min_v; this->acc_cmd = 0.0;}
+        if (ApplyEBrake && msg.ego_vehicle().position().x() > this->margin && this->priorcar_pos < 0 && msg.ego_vehicle().position().x() < 0 && this->priorcar_pos > this->margin)
+        {this->vel_cmd = 0.0; this->acc_cmd = 0.0; LOG_EVENT(Debug, InMargin, msg.ego_vehicle().position().x());}
+        LOG_EVENT(Debug, Command, this->vel_cmd, this->acc_cmd, this->da_cmd);
+    }
+
+private:
+    const PlannerMode mode;                         // How the acceleration candidates are evaluated
+    double priorcar_pos;                            // Define the position of the prior car
+    double priorcar_vel;                            // Define the velocity of the prior car
+    double priorcar_acc;                            // Define the acceleration of the prior car, estimated by the tracker
+    double vel_cmd;                                 // The velocity command sent to the ego car
+    double acc_cmd;                                 // The acceleration command for deciding next vel_cmd
+    double da_cmd;                                  // Jerk of every acceleration command
+    const int K;                                    // Number of steps for prediction horizon
+    const double Cv;                                // Factor for velocity term in cost function
+    const double Ca;                                // Factor for acceleration term in cost function
+    const double margin;                            // Margin as the safety distance before the intersection
+    const double vel_target;                        // Take max velocity as the target velocity
+    const double max_a, min_a, max_v, min_v;        // Acceleration and velocity constraints setup
+    const std::vector<float> da_list;               // Jerk constraints setup
+    const float dt;                                 // Time step in seconds
+    const double yield_line;                        // In the yield line ego car should defer to the prior car
+    bool YIELD;                                     // A signal indicating if the ego car should yield
+    std::vector<double> priorcar_predicted_pos;     // A vector for storing predicted positions of the prior car in K steps
+    std::vector<double> egocar_predicted_pos;       // A vector for storing predicted positions of the ego car in K steps
+    std::vector<double> acc_list;                   // Acceleration candidates for calculating cost function
+    std::vector<int> point_in_region_list;          // Point list that stored how many points are in the obstacle region
+    std::vector<double> cost_list;                  // Calculated costs according to acceleration candidates
+    std::vector<double> priorcar_surpass_pos_list;  // The list of positions of prior cars that can be surpassed
+    std::vector<double> priorcar_yield_pos_list;    // The list of positions of prior cars that need to be yielded
+    std::vector<double> priorcar_surpass_vel_list;  // The list of velocities of prior cars that can be surpassed
+    std::vector<double> priorcar_yield_vel_list;    // The list of velocities of prior cars that need to be yielded
+    std::vector<double> priorcar_surpass_acc_list;  // The list of accelerations of prior cars that can be surpassed
+    std::vector<double> priorcar_yield_acc_list;    // The list of accelerations of prior cars that need to be yielded
+    int points_in_region;                           // Number of points that are in the obstacle region for each acceleration
+    MpcKernel kernel;                               // Vectorized evaluation of the acceleration candidates
+    FixedMpcKernel<DefaultProfile> default_kernel;  // The same compiled for the parameters of DefaultProfile
+    FixedMpcKernel<LongHorizonProfile> long_horizon_kernel; // The same compiled for the parameters of LongHorizonProfile
+    KernelProfile profile;                          // Which of the kernels the Kernel mode uses
+    JerkSearch search;                              // Jerk sequence search of the JerkSearch mode
+    ConflictModel conflict = ConflictModel::PriorCar; // Which cars the collision check looks at
+    OccupancyGrid grid;                             // Predicted occupancy of all cars for ConflictModel::Occupancy
+    SampledPrediction sampled;                      // Sampled trajectories of the lane 1 cars for ConflictModel::Sampled
+    VehicleTracker tracker;                         // History of every detected car, estimates their accelerations
+    QpSolver qp;                                    // Continuous-acceleration solver of the Qp mode
+    AnalyticKernel analytic;                        // Closed-form evaluation of the Analytic mode
+};
+
+#endif // PLANNER_H
@@ -0,0 +1,614 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "planner.h"
+
+using namespace std;
+/**
+ * Microbenchmark of the planner stages. It builds synthetic world states with a given number
+ * of cars on a given mix of lanes and drives SetPriorCar, MakeDecision, PredictEgocarAcc,
+ * CalculateCost and SetVel of the Reference mode one by one, followed by a whole tick of every
+ * planner mode. For every stage it reports the mean and the p99 time per tick in nanoseconds and
+ * the heap allocations per tick after warm-up, first as the number of cars grows and then as the
+ * horizon K of the planning kernel, the jerk search, the occupancy grid, the QP solver and the
+ * closed-form kernel grows, then the sampled prediction as the number of samples grows, and last
+ * the runtime kernel against the kernels compiled for the profiles of mpc_profiles.h.
+ *
+ * Usage: planner_bench [--vehicles 1,10,100,1000] [--horizons 25,50,100,200] [--samples 64,256,1024]
+ *                      [--lanes 0123] [--ticks N] [--seed N] [--search-budget-ms T] [--check-allocations]
+ *                      [--check-windows] [--check-occupancy]
+ * With --check-allocations it exits with 3 if any measured tick allocated, the build runs it
+ * this way to keep the steady-state control loop allocation free. Sampling on the thread pool
+ * allocates its tasks and is left out of the check.
+ * With --check-windows it only compares the closed-form time windows of the analytic mode with
+ * a fine time grid on random motions and exits with 4 if they differ, the build runs it too.
+ * With --check-occupancy it only compares the occupancy grid with the positions of random cars,
+ * braking ones held where they stop, and exits with 5 if a step differs, the build runs it too.
+ */
+
+// Heap allocations made by the calling thread, counted by the replaced operators new below
+static thread_local long allocations = 0;
+
+// All forms of new and delete are replaced together, so every pointer is freed by the family that allocated it
+static void* CountedAlloc(size_t size)
+{
+    allocations++;
+    if (void* p = malloc(size ? size : 1)) {return p;}
+    throw bad_alloc();
+}
+
+static void CountedFree(void* p) noexcept { free(p); }
+
+void* operator new(size_t size) { return CountedAlloc(size); }
+void* operator new[](size_t size) { return CountedAlloc(size); }
+void* operator new(size_t size, const nothrow_t&) noexcept
+{
+    try {return CountedAlloc(size);} catch (const bad_alloc&) {return nullptr;}
+}
+void* operator new[](size_t size, const nothrow_t&) noexcept
+{
+    try {return CountedAlloc(size);} catch (const bad_alloc&) {return nullptr;}
+}
+
+void operator delete(void* p) noexcept { CountedFree(p); }
+void operator delete[](void* p) noexcept { CountedFree(p); }
+void operator delete(void* p, size_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, size_t) noexcept { CountedFree(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { CountedFree(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { CountedFree(p); }
+
+#if defined(__cpp_aligned_new)
+// Over-aligned types go through these, their memory comes from aligned_alloc and is freed with free
+static void* CountedAlignedAlloc(size_t size, align_val_t alignment)
+{
+    allocations++;
+    const size_t align = std::max((size_t)alignment, sizeof(void*));
+    if (void* p = aligned_alloc(align, (std::max(size, (size_t)1) + align - 1) / align * align)) {return p;}
+    throw bad_alloc();
+}
+
+void* operator new(size_t size, align_val_t alignment) { return CountedAlignedAlloc(size, alignment); }
+void* operator new[](size_t size, align_val_t alignment) { return CountedAlignedAlloc(size, alignment); }
+void operator delete(void* p, align_val_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, align_val_t) noexcept { CountedFree(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { CountedFree(p); }
+#endif
+
+/**
+ * Access to the stages of the planner, which are private to it.
+ */
+class PlannerBench {
+
+public:
+    static void SetPriorCar(Planner& planner, const custom_messages::WorldState& msg) { planner.SetPriorCar(msg); }
+    static void MakeDecision(Planner& planner, const custom_messages::WorldState& msg) { planner.MakeDecision(msg); }
+    static void PredictEgocarAcc(Planner& planner, const custom_messages::WorldState& msg) { planner.PredictEgocarAcc(msg); }
+    static void CalculateCost(Planner& planner, const custom_messages::WorldState& msg) { planner.CalculateCost(msg); }
+    static void SetVel(Planner& planner, const custom_messages::WorldState& msg) { planner.SetVel(msg); }
+    static PriorCarState Prior(const Planner& planner) { return { planner.priorcar_pos, planner.priorcar_vel, planner.priorcar_acc }; }
+    static bool Yield(const Planner& planner) { return planner.YIELD; }
+};
+
+/* Build a world state with num_vehicles cars spread over the given lanes (0-3), laid out
+*  like the intersection of the simulator: lane 0 is the road of the ego car along +x at y = 2,
+*  lane 1 comes from -y at x = -2, lane 2 from +x at y = -2 and lane 3 from +y at x = 2.
+ */
+custom_messages::WorldState MakeWorldState(mt19937_64& rng, int num_vehicles, const vector<int>& lanes)
+{
+    auto uniform = [&rng](double lo, double hi) {return uniform_real_distribution<double>(lo, hi)(rng);};
+    custom_messages::WorldState msg;
+    msg.set_simulation_round(1);
+    custom_messages::VehicleState* ego = msg.mutable_ego_vehicle();
+    ego->set_vehicle_id(0);
+    ego->set_lane_id(0);
+    ego->mutable_position()->set_x(uniform(-50.0, -10.0));
+    ego->mutable_position()->set_y(2.0);
+    ego->mutable_velocity()->set_x(uniform(5.0, 15.0));
+    ego->mutable_velocity()->set_y(0.0);
+    for (int i = 0; i < num_vehicles && !lanes.empty(); i++)
+    {
+        const int lane = lanes[rng() % lanes.size()];
+        const double s = uniform(-50.0, 10.0);      // Signed distance to the centre along the lane
+        const double v = uniform(3.0, 15.0);
+        double x = 0, y = 0, vx = 0, vy = 0;
+        switch (lane)
+        {
+            case 0: x = ego->position().x() + 10.0 + 50.0 + s; y = 2.0; vx = v; break;
+            case 1: x = -2.0; y = s; vy = v; break;
+            case 2: x = -s; y = -2.0; vx = -v; break;
+            default: x = 2.0; y = -s; vy = -v; break;
+        }
+        custom_messages::VehicleState* vehicle = msg.add_vehicles();
+        vehicle->set_vehicle_id(i + 1);
+        vehicle->set_lane_id(lane);
+        vehicle->mutable_position()->set_x(x);
+        vehicle->mutable_position()->set_y(y);
+        vehicle->mutable_velocity()->set_x(vx);
+        vehicle->mutable_velocity()->set_y(vy);
+    }
+    return msg;
+}
+
+// Time and allocations of one stage over all measured ticks
+struct StageSamples
+{
+    vector<double> ns;
+    long allocations = 0;
+
+    double Mean() const
+    {
+        double sum = 0.0;
+        for (double t : this->ns) {sum += t;}
+        return this->ns.empty() ? 0.0 : sum / this->ns.size();
+    }
+
+    double Percentile(double p)
+    {
+        if (this->ns.empty()) {return 0.0;}
+        const size_t rank = std::min(this->ns.size() - 1, (size_t)(p * this->ns.size()));
+        nth_element(this->ns.begin(), this->ns.begin() + rank, this->ns.end());
+        return this->ns[rank];
+    }
+};
+
+// Cost of reading the clock twice, subtracted from every sample
+static double timer_overhead = 0.0;
+
+/* Time one call of a stage and count its allocations.
+*  \param[in/out]: samples The samples of the stage, nothing is recorded during warm-up
+*  \param[in]: record False during warm-up
+ */
+template <typename Stage>
+void Measure(StageSamples& samples, bool record, Stage stage)
+{
+    const long allocations_before = allocations;
+    const auto start = chrono::steady_clock::now();
+    stage();
+    const auto end = chrono::steady_clock::now();
+    if (!record) {return;}
+    samples.allocations += allocations - allocations_before;
+    samples.ns.push_back(std::max(0.0, chrono::duration<double, nano>(end - start).count() - timer_overhead));
+}
+
+void CalibrateTimer()
+{
+    StageSamples samples;
+    samples.ns.reserve(100000);
+    for (int i = 0; i < 100000; i++) {Measure(samples, true, []() {});}
+    timer_overhead = samples.Percentile(0.5);
+}
+
+void PrintHeader(const char* first, const vector<string>& stages, int indent = 0)
+{
+    cout << string(indent, ' ') << setw(10) << first;
+    for (const string& stage : stages) {cout << setw(25) << stage;}
+    cout << endl << string(indent, ' ') << setw(10) << "";
+    for (size_t s = 0; s < stages.size(); s++) {cout << setw(25) << "mean/p99 ns   allocs";}
+    cout << endl;
+}
+
+// Print the samples of all stages and return their allocations
+long PrintRow(long first, vector<StageSamples>& samples, long ticks)
+{
+    long total_allocations = 0;
+    cout << setw(10) << first << fixed;
+    for (StageSamples& stage : samples)
+    {
+        cout << setw(8) << setprecision(0) << stage.Mean() << "/" << setw(8) << stage.Percentile(0.99)
+             << setw(8) << setprecision(2) << double(stage.allocations) / std::max(1L, ticks);
+        total_allocations += stage.allocations;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << endl;
+    return total_allocations;
+}
+
+vector<int> ParseList(const char* value)
+{
+    vector<int> list;
+    for (const char* c = value; *c; )
+    {
+        list.push_back(atoi(c));
+        while (*c && *c != ',') {c++;}
+        if (*c == ',') {c++;}
+    }
+    return list;
+}
+
+/* Compare the runtime kernel with the kernel compiled for a profile on the same world states.
+*  \param[in]: name The name of the profile
+*  \return: The allocations of all measured ticks
+ */
+template <class Profile>
+long BenchProfile(const char* name, const vector<custom_messages::WorldState>& messages, long warmup, long ticks)
+{
+    const MpcParams params = ProfileMpcConfig<Profile>::Params();
+    MpcKernel runtime(params);
+    FixedMpcKernel<Profile> fixed;
+    OccupancyGrid grid(params.K, params.dt);
+    Planner planner(PlannerMode::Reference);
+    vector<StageSamples> samples(4);
+    for (StageSamples& stage : samples) {stage.ns.reserve(ticks);}
+    long mismatches = 0;
+    double acc_cmd = 0.0;
+    for (long t = 0; t < warmup + ticks; t++)
+    {
+        const bool record = t >= warmup;
+        const custom_messages::WorldState& msg = messages[t % messages.size()];
+        PlannerBench::SetPriorCar(planner, msg);
+        PlannerBench::MakeDecision(planner, msg);
+        const EgoState ego = { msg.ego_vehicle().position().x(), msg.ego_vehicle().velocity().x() };
+        const PriorCarState prior = PlannerBench::Prior(planner);
+        const bool yield = PlannerBench::Yield(planner);
+        MpcResult expected, result;
+        Measure(samples[0], record, [&]() {expected = runtime.Solve(ego, prior, acc_cmd, yield);});
+        Measure(samples[1], record, [&]() {result = fixed.Solve(ego, prior, acc_cmd, yield);});
+        mismatches += (result.index != expected.index || result.cost != expected.cost) ? 1 : 0;
+        grid.Clear();
+        for (const auto& vehicle_msg : msg.vehicles())
+        {
+            grid.Insert({ vehicle_msg.position().x(), vehicle_msg.position().y(),
+                          vehicle_msg.velocity().x(), vehicle_msg.velocity().y(), 0.0, 0.0,
+                          vehicle_msg.lane_id() == 0 || vehicle_msg.lane_id() == 2 });
+        }
+        Measure(samples[2], record, [&]() {expected = runtime.Solve(ego, prior, acc_cmd, yield, &grid);});
+        Measure(samples[3], record, [&]() {result = fixed.Solve(ego, prior, acc_cmd, yield, &grid);});
+        mismatches += (result.index != expected.index || result.cost != expected.cost) ? 1 : 0;
+        acc_cmd = std::max(params.min_a, std::min(params.max_a, expected.acc));
+    }
+    cout << setw(16) << name;
+    const long allocations = PrintRow(params.K, samples, ticks);
+    if (mismatches > 0) {cout << "  " << mismatches << " results differ between the runtime and the fixed kernel" << endl;}
+    return allocations;
+}
+
+/* Compare the time two cars share a band, from the closed-form windows of AnalyticKernel, with
+*  the time counted on a fine grid. The first car moves with constant acceleration like the ego
+*  candidates, the second one is held where it stops like the prior car.
+*  \param[in]: seed The seed of the random motions
+*  \param[in]: cases The number of random motions
+*  \param[in]: grid_steps The number of grid points over the horizon
+*  \return: The largest difference in seconds
+ */
+double CheckWindows(uint64_t seed, int cases, int grid_steps)
+{
+    const double infinity = numeric_limits<double>::infinity();
+    // The bands of the analytic mode: near the intersection, the obstacle region, behind the margin and before the intersection
+    const double bands[4][2] = { { -5.0, 5.0 }, { -20.0, 0.0 }, { -10.0, infinity }, { -infinity, 0.0 } };
+    const double horizon = 5.0;
+    mt19937_64 rng(seed);
+    auto uniform = [&rng](double lo, double hi) {return uniform_real_distribution<double>(lo, hi)(rng);};
+    double worst = 0.0;
+    for (int c = 0; c < cases; c++)
+    {
+        const double* ego_band = bands[rng() % 4];
+        const double* prior_band = bands[rng() % 2];
+        const EgoState ego = { uniform(-40.0, 40.0), uniform(-5.0, 20.0) };
+        const double ego_acc = uniform(-4.0, 4.0);
+        const PriorCarState prior = { uniform(-40.0, 40.0), uniform(-2.0, 20.0), uniform(-8.0, 4.0) };
+        TimeWindows ego_windows, prior_windows;
+        ego_windows.Set(ego.pos, ego.vel, ego_acc, ego_band[0], ego_band[1], horizon);
+        prior_windows.SetStopping(prior.pos, prior.vel, prior.acc, prior_band[0], prior_band[1], horizon);
+        const double shared = ego_windows.Overlap(prior_windows);
+
+        // The midpoint of every grid cell stands for the whole cell
+        const double cell = horizon / grid_steps;
+        long inside = 0;
+        for (int i = 0; i < grid_steps; i++)
+        {
+            const double t = (i + 0.5) * cell;
+            const double ego_pos = ego.pos + ego.vel * t + 0.5 * ego_acc * t * t;
+            const double prior_pos = HoldAtStop(prior, t, prior.pos + prior.vel * t + 0.5 * prior.acc * t * t);
+            if (ego_pos > ego_band[0] && ego_pos < ego_band[1] && prior_pos > prior_band[0] && prior_pos < prior_band[1]) {inside++;}
+        }
+        worst = std::max(worst, std::abs(shared - inside * cell));
+    }
+    return worst;
+}
+
+/* Compare the occupancy grid with the predicted positions of random cars at every step. The
+*  first case is a crossing car that brakes to a standstill in the ego lane, its cells must stay
+*  blocked after its stop time.
+*  \param[in]: seed The seed of the random cars
+*  \param[in]: cases The number of random cars
+*  \return: The number of steps in which the grid differs
+ */
+long CheckOccupancy(uint64_t seed, int cases)
+{
+    const int K = 50;
+    const float dt = 0.1f;
+    const OccupancyParams params;
+    OccupancyGrid grid(K, dt, params);
+    mt19937_64 rng(seed);
+    auto uniform = [&rng](double lo, double hi) {return uniform_real_distribution<double>(lo, hi)(rng);};
+    // Constant acceleration until the velocity reaches 0, then standing
+    auto stopping = [](double p, double v, double a, double t)
+    {
+        if (v * a < 0) {t = std::min(t, -v / a);}
+        return p + v * t + 0.5 * a * t * t;
+    };
+    long mismatches = 0;
+    for (int c = 0; c < cases; c++)
+    {
+        VehiclePrediction vehicle;
+        if (c == 0)
+        {
+            // Stops at y = -1 after 1 s, inside the ego lane
+            vehicle = { -2.0, -4.0, 0.0, 6.0, 0.0, -6.0, false };
+        }
+        else if (rng() % 2)
+        {
+            vehicle = { uniform(-10.0, 10.0), uniform(-30.0, 30.0), 0.0, uniform(-15.0, 15.0), 0.0, uniform(-8.0, 8.0), false };
+        }
+        else
+        {
+            vehicle = { uniform(-50.0, 50.0), uniform(-1.0, 3.0), uniform(-15.0, 15.0), 0.0, uniform(-8.0, 8.0), 0.0, true };
+        }
+        const double half_y = 0.5 * (vehicle.along_x ? params.car_width : params.car_length);
+        const double reach_y = half_y + 0.5 * params.car_width + params.clearance;
+        grid.Clear();
+        grid.Insert(vehicle);
+        for (int k = 0; k < K; k++)
+        {
+            const double t = k * (double)dt;
+            const double x = stopping(vehicle.x, vehicle.vx, vehicle.ax, t);
+            const double y = stopping(vehicle.y, vehicle.vy, vehicle.ay, t);
+            const double off = std::abs(y - params.corridor_y) - reach_y;
+            // Positions within rounding of the band edge or off the grid are not compared
+            if (std::abs(off) < 1e-6 || x < params.x_min + 1.0 || x > params.x_max - 1.0) {continue;}
+            if (grid.Occupied(k, x) != (off < 0)) {mismatches++;}
+        }
+    }
+    return mismatches;
+}
+
+int main(int _argc, char **_argv)
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    vector<int> vehicle_counts = { 1, 10, 100, 1000 };
+    vector<int> horizons = { 25, 50, 100, 200 };
+    vector<int> sample_counts = { 64, 256, 1024 };
+    vector<int> lanes = { 0, 1, 2, 3 };
+    long ticks = 10000;
+    uint64_t seed = 1;
+    SearchParams search;
+    search.time_budget = 0.005;
+    bool check_allocations = false;
+    bool check_windows = false;
+    bool check_occupancy = false;
+    for (int i = 1; i < _argc; i++)
+    {
+        const char* arg = _argv[i];
+        if (!strcmp(arg, "--check-allocations")) {check_allocations = true; continue;}
+        if (!strcmp(arg, "--check-windows")) {check_windows = true; continue;}
+        if (!strcmp(arg, "--check-occupancy")) {check_occupancy = true; continue;}
+        const char* value = (i + 1 < _argc) ? _argv[i + 1] : nullptr;
+        if (value == nullptr) {cerr << "Missing value for " << arg << endl; return 1;}
+        if (!strcmp(arg, "--vehicles")) {vehicle_counts = ParseList(value);}
+        else if (!strcmp(arg, "--horizons")) {horizons = ParseList(value);}
+        else if (!strcmp(arg, "--samples")) {sample_counts = ParseList(value);}
+        else if (!strcmp(arg, "--ticks")) {ticks = std::max(1L, atol(value));}
+        else if (!strcmp(arg, "--seed")) {seed = strtoull(value, nullptr, 10);}
+        else if (!strcmp(arg, "--search-budget-ms")) {search.time_budget = atof(value) * 1e-3;}
+        else if (!strcmp(arg, "--lanes"))
+        {
+            lanes.clear();
+            for (const char* c = value; *c; c++) {if (*c >= '0' && *c <= '3') {lanes.push_back(*c - '0');}}
+        }
+        else {cerr << "Unknown argument " << arg << endl; return 1;}
+        i++;
+    }
+
+    if (check_windows)
+    {
+        // A grid cell of 50 us misses at most half a cell at every band boundary
+        const int cases = 2000, grid_steps = 100000;
+        const double tolerance = 1e-3;
+        const double worst = CheckWindows(seed, cases, grid_steps);
+        cout << "Closed-form windows against a grid of " << grid_steps << " steps, " << cases << " cases: largest difference "
+             << worst << " s" << endl;
+        if (worst > tolerance)
+        {
+            cerr << "Window check failed: the closed-form windows differ from the grid by " << worst << " s" << endl;
+            return 4;
+        }
+        return 0;
+    }
+    if (check_occupancy)
+    {
+        const int cases = 20000;
+        const long mismatches = CheckOccupancy(seed, cases);
+        cout << "Occupancy grid against the predicted positions of " << cases << " cars: " << mismatches << " steps differ" << endl;
+        if (mismatches > 0)
+        {
+            cerr << "Occupancy check failed: " << mismatches << " steps differ" << endl;
+            return 5;
+        }
+        return 0;
+    }
+
+    CalibrateTimer();
+    long steady_allocations = 0;                    // Allocations of all measured ticks
+    const long warmup = std::max(1L, ticks / 10);
+    const int num_messages = 64;                    // Distinct world states cycled through by the ticks
+    cout << "Timer overhead " << timer_overhead << " ns, " << ticks << " ticks after " << warmup << " warm-up ticks" << endl;
+
+    // Stages of the Reference mode and whole ticks of every mode as the number of cars grows
+    const vector<string> stage_names = { "SetPriorCar", "MakeDecision", "PredictEgocarAcc", "CalculateCost", "SetVel",
+                                         "Tick reference", "Tick kernel", "Tick search", "Tick occupancy", "Tick qp",
+                                         "Tick sampled", "Tick analytic" };
+    PrintHeader("vehicles", stage_names);
+    for (int num_vehicles : vehicle_counts)
+    {
+        mt19937_64 rng(seed);
+        vector<custom_messages::WorldState> messages;
+        for (int m = 0; m < num_messages; m++) {messages.push_back(MakeWorldState(rng, num_vehicles, lanes));}
+
+        Planner reference(PlannerMode::Reference);
+        Planner kernel(PlannerMode::Kernel);
+        Planner jerk(PlannerMode::JerkSearch);
+        jerk.Search().SetSearchParams(search);
+        Planner occupancy(PlannerMode::Kernel);
+        occupancy.SetConflictModel(ConflictModel::Occupancy);
+        Planner qp(PlannerMode::Qp);
+        Planner sampled(PlannerMode::Kernel);
+        sampled.SetConflictModel(ConflictModel::Sampled);
+        Planner analytic(PlannerMode::Analytic);
+        vector<StageSamples> samples(stage_names.size());
+        for (StageSamples& stage : samples) {stage.ns.reserve(ticks);}
+        const long search_ticks = std::max(1L, ticks / 10);
+        for (long t = 0; t < warmup + ticks; t++)
+        {
+            const bool record = t >= warmup;
+            const custom_messages::WorldState& msg = messages[t % num_messages];
+            Measure(samples[0], record, [&]() {PlannerBench::SetPriorCar(reference, msg);});
+            Measure(samples[1], record, [&]() {PlannerBench::MakeDecision(reference, msg);});
+            Measure(samples[2], record, [&]() {PlannerBench::PredictEgocarAcc(reference, msg);});
+            Measure(samples[3], record, [&]() {PlannerBench::CalculateCost(reference, msg);});
+            Measure(samples[4], record, [&]() {PlannerBench::SetVel(reference, msg);});
+            Measure(samples[5], record, [&]() {reference.Plan(msg);});
+            Measure(samples[6], record, [&]() {kernel.Plan(msg);});
+            if (t < warmup + search_ticks) {Measure(samples[7], record, [&]() {jerk.Plan(msg);});}
+            Measure(samples[8], record, [&]() {occupancy.Plan(msg);});
+            Measure(samples[9], record, [&]() {qp.Plan(msg);});
+            Measure(samples[10], record, [&]() {sampled.Plan(msg);});
+            Measure(samples[11], record, [&]() {analytic.Plan(msg);});
+        }
+        samples[7].allocations = samples[7].allocations * ticks / search_ticks;
+        steady_allocations += PrintRow(num_vehicles, samples, ticks);
+    }
+
+    // Kernel, search and occupancy grid as the horizon grows, the Reference stages are fixed to K = 50
+    const int grid_vehicles = 20;
+    const vector<string> horizon_names = { "Kernel", "Kernel occupancy", "Search", "Occupancy build", "Qp", "Analytic" };
+    cout << endl << "Horizon scaling with " << grid_vehicles << " vehicles" << endl;
+    PrintHeader("K", horizon_names);
+    for (int K : horizons)
+    {
+        mt19937_64 rng(seed);
+        vector<custom_messages::WorldState> messages;
+        for (int m = 0; m < num_messages; m++) {messages.push_back(MakeWorldState(rng, grid_vehicles, lanes));}
+
+        Planner planner(PlannerMode::Reference);
+        MpcParams params = planner.KernelParams();
+        params.K = K;
+        MpcKernel mpc(params);
+        JerkSearch jerk(params, search);
+        OccupancyGrid grid(K, params.dt);
+        QpSolver qp(params);
+        AnalyticKernel analytic(params);
+        vector<StageSamples> samples(horizon_names.size());
+        for (StageSamples& stage : samples) {stage.ns.reserve(ticks);}
+        const long search_ticks = std::max(1L, ticks / 10);
+        double acc_cmd = 0.0;
+        for (long t = 0; t < warmup + ticks; t++)
+        {
+            const bool record = t >= warmup;
+            const custom_messages::WorldState& msg = messages[t % num_messages];
+            PlannerBench::SetPriorCar(planner, msg);
+            PlannerBench::MakeDecision(planner, msg);
+            const EgoState ego = { msg.ego_vehicle().position().x(), msg.ego_vehicle().velocity().x() };
+            const PriorCarState prior = PlannerBench::Prior(planner);
+            const bool yield = PlannerBench::Yield(planner);
+            Measure(samples[0], record, [&]() {acc_cmd = mpc.Solve(ego, prior, acc_cmd, yield).acc;});
+            Measure(samples[3], record, [&]()
+            {
+                grid.Clear();
+                for (const auto& vehicle_msg : msg.vehicles())
+                {
+                    grid.Insert({ vehicle_msg.position().x(), vehicle_msg.position().y(),
+                                  vehicle_msg.velocity().x(), vehicle_msg.velocity().y(), 0.0, 0.0,
+                                  vehicle_msg.lane_id() == 0 || vehicle_msg.lane_id() == 2 });
+                }
+            });
+            Measure(samples[1], record, [&]() {mpc.Solve(ego, prior, acc_cmd, yield, &grid);});
+            if (t < warmup + search_ticks) {Measure(samples[2], record, [&]() {jerk.Solve(ego, prior, acc_cmd, yield, &grid);});}
+            Measure(samples[4], record, [&]() {qp.Solve(ego, prior, acc_cmd, yield);});
+            Measure(samples[5], record, [&]() {analytic.Solve(ego, prior, acc_cmd, yield);});
+            acc_cmd = std::max(params.min_a, std::min(params.max_a, acc_cmd));
+        }
+        samples[2].allocations = samples[2].allocations * ticks / search_ticks;
+        steady_allocations += PrintRow(K, samples, ticks);
+    }
+
+    // Sampling alone, on all cores and the kernel scoring its candidates against the samples
+    ThreadPool pool(std::max(1u, thread::hardware_concurrency()));
+    const vector<string> sample_names = { "Sample", "Sample pooled", "Kernel sampled" };
+    cout << endl << "Sample scaling with " << grid_vehicles << " vehicles, " << pool.Size() << " pool threads" << endl;
+    PrintHeader("samples", sample_names);
+    for (int num_samples : sample_counts)
+    {
+        mt19937_64 rng(seed);
+        vector<custom_messages::WorldState> messages;
+        for (int m = 0; m < num_messages; m++) {messages.push_back(MakeWorldState(rng, grid_vehicles, lanes));}
+
+        Planner planner(PlannerMode::Reference);
+        const MpcParams params = planner.KernelParams();
+        MpcKernel mpc(params);
+        SampleParams sample;
+        sample.samples = num_samples;
+        sample.task_samples = 64;
+        SampledPrediction inline_samples(params.K, params.dt, sample);
+        SampledPrediction pooled_samples(params.K, params.dt, sample, &pool);
+        vector<StageSamples> samples(sample_names.size());
+        for (StageSamples& stage : samples) {stage.ns.reserve(ticks);}
+        double acc_cmd = 0.0;
+        for (long t = 0; t < warmup + ticks; t++)
+        {
+            const bool record = t >= warmup;
+            const custom_messages::WorldState& msg = messages[t % num_messages];
+            PlannerBench::SetPriorCar(planner, msg);
+            PlannerBench::MakeDecision(planner, msg);
+            const EgoState ego = { msg.ego_vehicle().position().x(), msg.ego_vehicle().velocity().x() };
+            const PriorCarState prior = PlannerBench::Prior(planner);
+            const bool yield = PlannerBench::Yield(planner);
+            inline_samples.Clear();
+            pooled_samples.Clear();
+            for (const auto& vehicle_msg : msg.vehicles())
+            {
+                if (vehicle_msg.lane_id() == 1 && vehicle_msg.position().y() < sample.near)
+                {
+                    inline_samples.Add(vehicle_msg.position().y(), vehicle_msg.velocity().y(), 0.0);
+                    pooled_samples.Add(vehicle_msg.position().y(), vehicle_msg.velocity().y(), 0.0);
+                }
+            }
+            Measure(samples[0], record, [&]() {inline_samples.Sample((uint64_t)t);});
+            Measure(samples[1], record, [&]() {pooled_samples.Sample((uint64_t)t);});
+            Measure(samples[2], record, [&]() {acc_cmd = mpc.Solve(ego, prior, acc_cmd, yield, nullptr, &inline_samples).acc;});
+            acc_cmd = std::max(params.min_a, std::min(params.max_a, acc_cmd));
+        }
+        // The pool allocates the tasks it runs, only the single-threaded stages have to be allocation free
+        steady_allocations += PrintRow(num_samples, samples, ticks) - samples[1].allocations;
+    }
+
+    // Runtime kernel against the kernels compiled for the planner profiles
+    const vector<string> profile_names = { "Runtime kernel", "Fixed kernel", "Runtime occupancy", "Fixed occupancy" };
+    cout << endl << "Compiled profiles with " << grid_vehicles << " vehicles" << endl;
+    PrintHeader("K", profile_names, 16);
+    {
+        mt19937_64 rng(seed);
+        vector<custom_messages::WorldState> messages;
+        for (int m = 0; m < num_messages; m++) {messages.push_back(MakeWorldState(rng, grid_vehicles, lanes));}
+        steady_allocations += BenchProfile<DefaultProfile>("DefaultProfile", messages, warmup, ticks);
+        steady_allocations += BenchProfile<LongHorizonProfile>("LongHorizon", messages, warmup, ticks);
+    }
+
+    google::protobuf::ShutdownProtobufLibrary();
+    if (check_allocations && steady_allocations > 0)
+    {
+        cerr << "Allocation check failed: " << steady_allocations << " heap allocations after warm-up" << endl;
+        return 3;
+    }
+    return 0;
+}
@@ -0,0 +1,458 @@
+#ifndef QP_SOLVER_H
+#define QP_SOLVER_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "mpc_kernel.h"
+
+/**
+ * Continuous-acceleration MPC. Instead of holding one of the few accelerations of da_list over
+ * the horizon, every step of the horizon gets its own acceleration a_k, and the cost of
+ * CalculateCost becomes a quadratic program over them:
+ *
+ *     min  sum_k Cv*(vel_target - v_k+1)^2 + Ca*a_k^2 + Cj*(a_k - a_k-1)^2
+ *     s.t. min_a <= a_k <= max_a, |a_k - a_k-1| <= max jerk, v_k+1 <= max_v,
+ *          p_k+1 <= margin in the steps the prior car has the right of way (YIELD only)
+ *
+ * with v_k+1 = v_k + a_k*dt, p_k+1 = p_k + v_k+1*dt and a_-1 = acc_cmd. The jerk term Cj makes
+ * the profile smooth, the largest jerk of da_list bounds it. The QP is solved with ADMM (the
+ * OSQP iteration): every iteration solves one linear system whose matrix P + sigma*I + A'RA
+ * depends only on the weights, the horizon and the step sizes rho, not on the state, so its
+ * Cholesky factor is kept across ticks; a tick only changes the bounds and the linear term.
+ * The factor is only computed again when the residuals call for step sizes 5 times larger or
+ * smaller (the adaptive rho of OSQP), from Gram matrices of the constraint blocks computed in
+ * the constructor. The constraint matrix A is applied matrix-free, its rows are the
+ * accelerations, their differences and their first and second running sums, so A*x and A'*y
+ * cost O(K) and an iteration costs O(K^2) for the two triangular solves. The previous solution,
+ * shifted by one step, is the starting point of the next tick. All buffers are sized in the
+ * constructor.
+ *
+ * There is no lower velocity bound: with the jerk bound, stopping at the margin and staying at
+ * min_v are not always possible together, and the cost never plans below min_v otherwise.
+ * ApplyAcc keeps the velocity command above min_v. When the ego car cannot stop before the
+ * margin anymore, it brakes as hard as the jerk bound allows without solving the QP.
+ */
+
+// Parameters of the QP mode on top of MpcParams
+struct QpParams
+{
+    double Ca = 16.0;                               // Factor for acceleration term, replaces MpcParams::Ca tuned for held accelerations
+    double Cj = 20.0;                               // Factor for the jerk term in cost function
+    int max_iterations = 100;                       // ADMM iterations per tick
+    int check_every = 10;                           // Iterations between two convergence checks
+    double eps_abs = 1e-4, eps_rel = 1e-4;          // Convergence tolerances of the residuals
+    double rho_acc = 10.0, rho_jerk = 100.0;        // ADMM step sizes of the acceleration and jerk rows
+    double rho_vel = 0.01, rho_pos = 0.01;          // ADMM step sizes of the velocity and position rows, their entries are running sums
+    double rho_tolerance = 5.0;                     // Factor the step sizes must be off by before they are adapted
+    double sigma = 1e-6;                            // Regularization of the linear system
+    double alpha = 1.6;                             // Over-relaxation
+};
+
+// Counters of the last solve
+struct QpStats
+{
+    int iterations;
+    int factorizations;                             // Factorizations since the constructor, one until rho is adapted
+    bool converged;
+    double primal_residual;
+    double dual_residual;
+};
+
+class QpSolver {
+
+public:
+    /* Constructor
+    *  Factorize the matrix of the ADMM linear system and size all buffers
+    *  \param[in]: params The planner parameters, the horizon, weights and limits of the QP
+    *  \param[in]: qp The parameters of the QP and of ADMM
+     */
+    explicit QpSolver(const MpcParams& params = MpcParams(), const QpParams& qp = QpParams())
+        : params(params), qp(qp), N(params.K)
+    {
+        const int N = this->N;
+        const int M = kBlocks * N;
+        this->max_jerk = 0.0;
+        for (float da : params.da_list) {this->max_jerk = std::max(this->max_jerk, (double)std::abs(da));}
+        this->pos_scale = 1.0 / N;
+        this->x.assign(N, 0.0);
+        this->x_tilde.assign(N, 0.0);
+        this->rhs.assign(N, 0.0);
+        this->q.assign(N, 0.0);
+        this->work.assign(N, 0.0);
+        this->work_m.assign(M, 0.0);
+        this->z.assign(M, 0.0);
+        this->y.assign(M, 0.0);
+        this->lo.assign(M, 0.0);
+        this->hi.assign(M, 0.0);
+        this->rho.assign(M, 0.0);
+
+        // Dense A, only used to build the terms of the linear system
+        std::vector<double> A((size_t)M * N, 0.0);
+        std::vector<double> column(M);
+        for (int j = 0; j < N; j++)
+        {
+            std::fill(this->x.begin(), this->x.end(), 0.0);
+            this->x[j] = 1.0;
+            Multiply(this->x, column);
+            for (int i = 0; i < M; i++) {A[(size_t)i * N + j] = column[i];}
+        }
+        std::fill(this->x.begin(), this->x.end(), 0.0);
+        // P + sigma*I and the Gram matrix A_b'A_b of every block, lower triangles
+        this->terms.assign((size_t)(kBlocks + 1) * N * N, 0.0);
+        this->factor.assign((size_t)N * N, 0.0);
+        std::vector<double> column_p(N);
+        for (int r = 0; r < N; r++)
+        {
+            std::fill(this->work.begin(), this->work.end(), 0.0);
+            this->work[r] = 1.0;
+            MultiplyP(this->work, column_p);
+            for (int c = 0; c <= r; c++)
+            {
+                this->terms[(size_t)r * N + c] = column_p[c] + ((r == c) ? qp.sigma : 0.0);
+                for (int i = 0; i < M; i++)
+                {
+                    this->terms[(size_t)(1 + i / N) * N * N + (size_t)r * N + c] += A[(size_t)i * N + r] * A[(size_t)i * N + c];
+                }
+            }
+        }
+        Factorize(1.0);
+        Reset();
+    }
+
+    // Forget the previous solution, when a new simulation round starts
+    void Reset()
+    {
+        this->warm = false;
+        std::fill(this->x.begin(), this->x.end(), 0.0);
+        std::fill(this->z.begin(), this->z.end(), 0.0);
+        std::fill(this->y.begin(), this->y.end(), 0.0);
+    }
+
+    const QpParams& Params() const { return this->qp; }
+    const QpStats& Stats() const { return this->stats; }
+
+    // The acceleration of every step of the horizon after the last Solve
+    const std::vector<double>& Solution() const { return this->x; }
+
+    /* Solve the QP of the current state and return the acceleration of its first step.
+    *  \param[in]: ego The current position and velocity of the ego car
+    *  \param[in]: prior The current position, velocity and acceleration of the prior car
+    *  \param[in]: acc_cmd The acceleration command from the previous time step
+    *  \param[in]: yield The YIELD signal of the decision step
+    *  \return: The acceleration of the first step and the cost of the solution, index is always -1
+     */
+    MpcResult Solve(const EgoState& ego, const PriorCarState& prior, double acc_cmd, bool yield)
+    {
+        const int N = this->N;
+        const int M = kBlocks * N;
+        if (!SetBounds(ego, prior, acc_cmd, yield))
+        {
+            // Too late to stop before the margin, brake as hard as the jerk bound allows and start cold on the next tick
+            this->warm = false;
+            this->stats.iterations = 0;
+            this->stats.converged = false;
+            MpcResult result = { -1, std::max(this->params.min_a, acc_cmd - this->max_jerk), std::numeric_limits<double>::infinity() };
+            return result;
+        }
+        SetLinearTerm(ego, acc_cmd);
+        WarmStart(acc_cmd);
+
+        const double alpha = this->qp.alpha, sigma = this->qp.sigma;
+        this->stats.iterations = 0;
+        this->stats.converged = false;
+        for (int iteration = 1; iteration <= this->qp.max_iterations; iteration++)
+        {
+            // x~ = (P + sigma*I + A'RA)^-1 (sigma*x - q + A'(R*z - y))
+            for (int i = 0; i < M; i++) {this->work_m[i] = this->rho[i] * this->z[i] - this->y[i];}
+            MultiplyTransposed(this->work_m, this->rhs);
+            for (int k = 0; k < N; k++) {this->rhs[k] += sigma * this->x[k] - this->q[k];}
+            SolveFactored(this->rhs, this->x_tilde);
+            // z~ = A x~, relaxed updates of x and z, projection of z on the bounds and dual update
+            Multiply(this->x_tilde, this->work_m);
+            for (int k = 0; k < N; k++) {this->x[k] = alpha * this->x_tilde[k] + (1.0 - alpha) * this->x[k];}
+            for (int i = 0; i < M; i++)
+            {
+                const double z_relaxed = alpha * this->work_m[i] + (1.0 - alpha) * this->z[i];
+                const double z_next = std::min(this->hi[i], std::max(this->lo[i], z_relaxed + this->y[i] / this->rho[i]));
+                this->y[i] += this->rho[i] * (z_relaxed - z_next);
+                this->z[i] = z_next;
+            }
+            this->stats.iterations = iteration;
+            if (iteration % this->qp.check_every == 0 && Converged()) {this->stats.converged = true; break;}
+        }
+        if (!this->stats.converged) {Converged();}
+        this->warm = true;
+
+        // The first step, projected on the limits in case ADMM stopped early
+        double acc = std::min(acc_cmd + this->max_jerk, std::max(acc_cmd - this->max_jerk, this->x[0]));
+        acc = std::min(this->params.max_a, std::max(this->params.min_a, acc));
+        MultiplyP(this->x, this->work);
+        double cost = 0.0;
+        for (int k = 0; k < N; k++) {cost += this->x[k] * (0.5 * this->work[k] + this->q[k]);}
+        MpcResult result = { -1, acc, cost };
+        return result;
+    }
+
+private:
+    static const int kBlocks = 4;                   // Constraint blocks: acceleration, jerk, velocity, position
+    static constexpr double kStopSlack = 1.0;       // Room in meters the QP needs between the braking distance and the margin
+
+    /* A*x, the constraint rows of all blocks. Row k of the jerk block is x_k - x_k-1, of the
+    *  velocity block the running sum of x up to k, of the position block the running sum of
+    *  those sums, scaled by pos_scale.
+     */
+    void Multiply(const std::vector<double>& in, std::vector<double>& out) const
+    {
+        const int N = this->N;
+        double sum = 0.0, sum_of_sums = 0.0;
+        for (int k = 0; k < N; k++)
+        {
+            sum += in[k];
+            sum_of_sums += sum;
+            out[k] = in[k];
+            out[N + k] = in[k] - ((k > 0) ? in[k - 1] : 0.0);
+            out[2 * N + k] = sum;
+            out[3 * N + k] = this->pos_scale * sum_of_sums;
+        }
+    }
+
+    // A'*y, the running sums become running sums from the end of the horizon
+    void MultiplyTransposed(const std::vector<double>& in, std::vector<double>& out) const
+    {
+        const int N = this->N;
+        double sum = 0.0, sum_of_sums = 0.0;
+        for (int k = N - 1; k >= 0; k--)
+        {
+            sum_of_sums += this->pos_scale * in[3 * N + k];
+            sum += in[2 * N + k] + sum_of_sums;
+            out[k] = in[k] + in[N + k] - ((k + 1 < N) ? in[N + k + 1] : 0.0) + sum;
+        }
+    }
+
+    // P*x with P = 2*(Cv*dt^2*L'L + Ca*I + Cj*D'D), L the running sum and D the difference, Ca of QpParams
+    void MultiplyP(const std::vector<double>& in, std::vector<double>& out) const
+    {
+        const int N = this->N;
+        const double dt = this->params.dt;
+        const double cv = 2.0 * this->params.Cv * dt * dt, ca = 2.0 * this->qp.Ca, cj = 2.0 * this->qp.Cj;
+        // L'L x is the running sum from the end of the running sum from the start
+        double sum = 0.0;
+        for (int k = 0; k < N; k++) {sum += in[k]; out[k] = sum;}
+        double back = 0.0;
+        for (int k = N - 1; k >= 0; k--)
+        {
+            back += out[k];
+            const double d = in[k] - ((k > 0) ? in[k - 1] : 0.0);
+            const double d_next = (k + 1 < N) ? in[k + 1] - in[k] : 0.0;
+            out[k] = cv * back + ca * in[k] + cj * (d - d_next);
+        }
+    }
+
+    // q from the velocity error of the current velocity and the jerk of the first step
+    void SetLinearTerm(const EgoState& ego, double acc_cmd)
+    {
+        const int N = this->N;
+        const double dt = this->params.dt;
+        const double error = this->params.vel_target - ego.vel;
+        for (int k = 0; k < N; k++) {this->q[k] = -2.0 * this->params.Cv * dt * error * (N - k);}
+        this->q[0] -= 2.0 * this->qp.Cj * acc_cmd;
+    }
+
+    /* Bounds of all constraint rows. In YIELD the ego car has to stay behind the margin in every
+    *  step in which the prior car is between yield_line and the intersection or near it.
+    *  \return: false if even braking as hard as the jerk bound allows does not stop the ego car
+    *           kStopSlack before the margin in these steps, the QP would be (nearly) infeasible
+     */
+    bool SetBounds(const EgoState& ego, const PriorCarState& prior, double acc_cmd, bool yield)
+    {
+        const int N = this->N;
+        const double dt = this->params.dt;
+        const double inf = std::numeric_limits<double>::infinity();
+        double brake_acc = acc_cmd, brake_vel = ego.vel, brake_pos = ego.pos;
+        bool can_stop = true;
+        for (int k = 0; k < N; k++)
+        {
+            this->lo[k] = this->params.min_a;
+            this->hi[k] = this->params.max_a;
+            this->lo[N + k] = (k == 0) ? acc_cmd - this->max_jerk : -this->max_jerk;
+            this->hi[N + k] = (k == 0) ? acc_cmd + this->max_jerk : this->max_jerk;
+            this->lo[2 * N + k] = -inf;
+            this->hi[2 * N + k] = (this->params.max_v - ego.vel) / dt;
+            // Position after step k with the prior car at the same time
+            const double t = (k + 1) * dt;
+            const double prior_pos = HoldAtStop(prior, t, prior.pos + prior.vel * t + 0.5 * prior.acc * t * t);
+            const bool conflict = (prior_pos < 0 && prior_pos > this->params.yield_line) || std::abs(prior_pos) < 5;
+            brake_acc = std::max(this->params.min_a, brake_acc - this->max_jerk);
+            brake_vel = std::max(this->params.min_v, brake_vel + brake_acc * dt);
+            brake_pos += brake_vel * dt;
+            this->lo[3 * N + k] = -inf;
+            this->hi[3 * N + k] = inf;
+            if (yield && conflict)
+            {
+                this->hi[3 * N + k] = this->pos_scale * (this->params.margin - ego.pos - t * ego.vel) / (dt * dt);
+                can_stop = can_stop && brake_pos < this->params.margin - kStopSlack;
+            }
+        }
+        return can_stop;
+    }
+
+    // Start from the previous solution one step further, or from holding acc_cmd
+    void WarmStart(double acc_cmd)
+    {
+        const int N = this->N;
+        if (!this->warm)
+        {
+            std::fill(this->x.begin(), this->x.end(), acc_cmd);
+            std::fill(this->y.begin(), this->y.end(), 0.0);
+        }
+        else
+        {
+            for (int b = 0; b < kBlocks; b++)
+            {
+                double* y_block = &this->y[b * N];
+                std::copy(y_block + 1, y_block + N, y_block);
+                y_block[N - 1] = 0.0;
+            }
+            std::copy(this->x.begin() + 1, this->x.end(), this->x.begin());
+        }
+        Multiply(this->x, this->z);
+        for (size_t i = 0; i < this->z.size(); i++) {this->z[i] = std::min(this->hi[i], std::max(this->lo[i], this->z[i]));}
+    }
+
+    // Residuals of the current iterate, true if both are within the tolerances
+    bool Converged()
+    {
+        const int N = this->N;
+        const int M = kBlocks * N;
+        // Primal residual A x - z
+        Multiply(this->x, this->work_m);
+        double primal = 0.0, ax_norm = 0.0, z_norm = 0.0;
+        for (int i = 0; i < M; i++)
+        {
+            primal = std::max(primal, std::abs(this->work_m[i] - this->z[i]));
+            ax_norm = std::max(ax_norm, std::abs(this->work_m[i]));
+            z_norm = std::max(z_norm, std::abs(this->z[i]));
+        }
+        // Dual residual P x + q + A' y
+        MultiplyTransposed(this->y, this->rhs);
+        MultiplyP(this->x, this->work);
+        double dual = 0.0, px_norm = 0.0, aty_norm = 0.0, q_norm = 0.0;
+        for (int k = 0; k < N; k++)
+        {
+            dual = std::max(dual, std::abs(this->work[k] + this->q[k] + this->rhs[k]));
+            px_norm = std::max(px_norm, std::abs(this->work[k]));
+            aty_norm = std::max(aty_norm, std::abs(this->rhs[k]));
+            q_norm = std::max(q_norm, std::abs(this->q[k]));
+        }
+        this->stats.primal_residual = primal;
+        this->stats.dual_residual = dual;
+        const double primal_scale = std::max(ax_norm, z_norm), dual_scale = std::max(px_norm, std::max(aty_norm, q_norm));
+        if (primal <= this->qp.eps_abs + this->qp.eps_rel * primal_scale &&
+            dual <= this->qp.eps_abs + this->qp.eps_rel * dual_scale)
+        {
+            return true;
+        }
+        // Balance the residuals (the adaptive rho of OSQP), the factor is only computed again on a big change
+        const double ratio = std::sqrt((primal / (primal_scale + 1e-10)) / (dual / (dual_scale + 1e-10) + 1e-10));
+        const double max_scale = 1e6;
+        const double scale = std::min(max_scale, std::max(1.0 / max_scale, this->rho_scale * ratio));
+        if (scale > this->qp.rho_tolerance * this->rho_scale || scale * this->qp.rho_tolerance < this->rho_scale)
+        {
+            Factorize(scale);
+        }
+        return false;
+    }
+
+    // Set the step sizes to scale times the ones of the blocks and factorize P + sigma*I + A'RA
+    void Factorize(double scale)
+    {
+        const int N = this->N;
+        const double block_rho[kBlocks] = { this->qp.rho_acc, this->qp.rho_jerk, this->qp.rho_vel, this->qp.rho_pos };
+        this->rho_scale = scale;
+        for (int i = 0; i < kBlocks * N; i++) {this->rho[i] = scale * block_rho[i / N];}
+        for (int r = 0; r < N; r++)
+        {
+            for (int c = 0; c <= r; c++)
+            {
+                const size_t e = (size_t)r * N + c;
+                double sum = this->terms[e];
+                for (int b = 0; b < kBlocks; b++) {sum += this->rho[b * N] * this->terms[(size_t)(1 + b) * N * N + e];}
+                this->factor[e] = sum;
+            }
+        }
+        Cholesky();
+        this->stats.factorizations++;
+    }
+
+    // Cholesky factor L of the matrix in factor, in place in its lower triangle, mirrored to L' in the upper one
+    void Cholesky()
+    {
+        const int N = this->N;
+        for (int j = 0; j < N; j++)
+        {
+            double diagonal = this->factor[(size_t)j * N + j];
+            for (int k = 0; k < j; k++) {diagonal -= this->factor[(size_t)j * N + k] * this->factor[(size_t)j * N + k];}
+            diagonal = std::sqrt(diagonal);
+            this->factor[(size_t)j * N + j] = diagonal;
+            for (int i = j + 1; i < N; i++)
+            {
+                double sum = this->factor[(size_t)i * N + j];
+                for (int k = 0; k < j; k++) {sum -= this->factor[(size_t)i * N + k] * this->factor[(size_t)j * N + k];}
+                this->factor[(size_t)i * N + j] = sum / diagonal;
+            }
+        }
+        for (int i = 0; i < N; i++)
+        {
+            for (int j = 0; j < i; j++) {this->factor[(size_t)j * N + i] = this->factor[(size_t)i * N + j];}
+        }
+    }
+
+    /* Solve L L' out = in with the cached factor. Both substitutions subtract a solved value times
+    *  a contiguous row (of L' going forward, of L going back) from the rest of out, instead of
+    *  summing dot products whose additions wait on each other, so the inner loops vectorize.
+     */
+    void SolveFactored(const std::vector<double>& in, std::vector<double>& out) const
+    {
+        const int N = this->N;
+        std::copy(in.begin(), in.end(), out.begin());
+        for (int j = 0; j < N; j++)
+        {
+            const double* row = &this->factor[(size_t)j * N];
+            const double value = out[j] / row[j];
+            out[j] = value;
+            for (int i = j + 1; i < N; i++) {out[i] -= row[i] * value;}
+        }
+        for (int i = N - 1; i >= 0; i--)
+        {
+            const double* row = &this->factor[(size_t)i * N];
+            const double value = out[i] / row[i];
+            out[i] = value;
+            for (int j = 0; j < i; j++) {out[j] -= row[j] * value;}
+        }
+    }
+
+    const MpcParams params;
+    const QpParams qp;
+    const int N;                                    // Number of steps for prediction horizon, one acceleration each
+    double max_jerk;                                // Largest absolute jerk of da_list, the jerk bound of every step
+    double pos_scale;                               // Scale of the position rows, keeps them in the range of the others
+    std::vector<double> terms;                      // P + sigma*I and A_b'A_b of every block, row major lower triangles
+    std::vector<double> factor;                     // Cholesky factor L of P + sigma*I + A'RA and L', row major
+    double rho_scale = 1.0;                         // Adaptation of the step sizes, kept across ticks with the factor
+    std::vector<double> x;                          // Accelerations of the horizon
+    std::vector<double> x_tilde;                    // Solution of the linear system of the current iteration
+    std::vector<double> z;                          // Constraint rows projected on their bounds
+    std::vector<double> y;                          // Dual variables of the constraint rows
+    std::vector<double> q;                          // Linear term of the cost
+    std::vector<double> lo, hi;                     // Bounds of the constraint rows
+    std::vector<double> rho;                        // ADMM step size of every constraint row
+    std::vector<double> rhs;                        // Right hand side of the linear system
+    std::vector<double> work;                       // Scratch of size N
+    std::vector<double> work_m;                     // Scratch of the size of the constraint rows
+    bool warm = false;                              // If x, z and y hold the solution of the previous tick
+    QpStats stats = { 0, 0, false, 0.0, 0.0 };
+};
+
+#endif // QP_SOLVER_H
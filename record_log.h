@@ -0,0 +1,217 @@
+#ifndef RECORD_LOG_H
+#define RECORD_LOG_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <google/protobuf/message_lite.h>
+
+/**
+ * Append-only binary log of the messages exchanged with the simulator, for deterministic replay
+ * (replay.cpp). The file starts with a RecordFileHeader, followed by records made of a
+ * RecordHeader and the serialized protobuf message. Every record carries a sequence number:
+ * the number of the world state for WorldState records, and for Command and Statistics records
+ * the number of the world state they belong to, so commands can be matched with the state they
+ * were planned on even when the planner skipped states. A record cut off at the end of the file
+ * (the recording process died while writing) is ignored by the reader.
+ */
+
+enum class RecordType : uint32_t
+{
+    WorldState = 1,
+    Command = 2,
+    Statistics = 3
+};
+
+struct RecordFileHeader
+{
+    char magic[8];                                  // kRecordMagic
+    uint32_t version;                               // kRecordVersion
+    uint32_t reserved;
+};
+
+struct RecordHeader
+{
+    uint32_t size;                                  // Bytes of the message following the header
+    uint32_t type;                                  // RecordType
+    uint64_t sequence;                              // Number of the world state of the record
+};
+
+static const char kRecordMagic[8] = { 'P', 'L', 'A', 'N', 'L', 'O', 'G', '\0' };
+static const uint32_t kRecordVersion = 1;
+
+/**
+ * Writes records to a log file. Write can be called from several threads, a record is
+ * serialized into a reused buffer and appended with a single buffered write under a lock.
+ */
+class RecordWriter {
+
+public:
+    RecordWriter() {}
+    RecordWriter(const RecordWriter&) = delete;
+    RecordWriter& operator=(const RecordWriter&) = delete;
+
+    ~RecordWriter() { Close(); }
+
+    /* Create the log file, an existing file is overwritten.
+    *  \return: false if the file could not be created
+     */
+    bool Open(const std::string& path)
+    {
+        Close();
+        this->file = std::fopen(path.c_str(), "wb");
+        if (this->file == nullptr) {return false;}
+        std::setvbuf(this->file, nullptr, _IOFBF, 1 << 20);
+        RecordFileHeader header = {};
+        std::memcpy(header.magic, kRecordMagic, sizeof(header.magic));
+        header.version = kRecordVersion;
+        return std::fwrite(&header, sizeof(header), 1, this->file) == 1;
+    }
+
+    bool IsOpen() const { return this->file != nullptr; }
+
+    // Append one record
+    void Write(RecordType type, uint64_t sequence, const google::protobuf::MessageLite& msg)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->file == nullptr) {return;}
+        this->buffer.clear();
+        Append(type, sequence, msg, this->buffer);
+        std::fwrite(this->buffer.data(), 1, this->buffer.size(), this->file);
+    }
+
+    // Append records collected with Append, they stay together in the file
+    void WriteRaw(const std::string& records)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->file == nullptr) {return;}
+        std::fwrite(records.data(), 1, records.size(), this->file);
+    }
+
+    void Flush()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->file) {std::fflush(this->file);}
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->file) {std::fclose(this->file);}
+        this->file = nullptr;
+    }
+
+    // Serialize a record to the end of out, without touching the file
+    static void Append(RecordType type, uint64_t sequence, const google::protobuf::MessageLite& msg, std::string& out)
+    {
+        RecordHeader header;
+        header.size = (uint32_t)msg.ByteSizeLong();
+        header.type = (uint32_t)type;
+        header.sequence = sequence;
+        const size_t start = out.size();
+        out.resize(start + sizeof(header) + header.size);
+        std::memcpy(&out[start], &header, sizeof(header));
+        msg.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(&out[start + sizeof(header)]));
+    }
+
+private:
+    std::FILE* file = nullptr;
+    std::mutex mutex;                               // Keeps the records of several threads apart
+    std::string buffer;                             // Serialized record, reused
+};
+
+// A record inside a mapped log
+struct RecordView
+{
+    RecordType type;
+    uint64_t sequence;
+    size_t offset;                                  // Offset of the record header in the file
+    const uint8_t* data;                            // The serialized message
+    uint32_t size;
+
+    // Parse the message of the record, false if it is corrupt
+    bool Parse(google::protobuf::MessageLite& msg) const { return msg.ParseFromArray(this->data, (int)this->size); }
+};
+
+/**
+ * Read-only memory mapping of a log file. The records are read in place, the kernel pages
+ * the file in as it is walked.
+ */
+class MappedLog {
+
+public:
+    MappedLog() {}
+    MappedLog(const MappedLog&) = delete;
+    MappedLog& operator=(const MappedLog&) = delete;
+
+    ~MappedLog()
+    {
+        if (this->base) {munmap(const_cast<uint8_t*>(this->base), this->length);}
+    }
+
+    /* Map a log file and check its header.
+    *  \param[out]: error Why the file cannot be read
+    *  \return: false if the file is not a log of this version
+     */
+    bool Open(const std::string& path, std::string& error)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {error = "cannot open " + path; return false;}
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(RecordFileHeader))
+        {
+            ::close(fd);
+            error = path + " is too short";
+            return false;
+        }
+        this->length = (size_t)info.st_size;
+        void* base = mmap(nullptr, this->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {error = "cannot map " + path; this->length = 0; return false;}
+        this->base = static_cast<const uint8_t*>(base);
+        madvise(base, this->length, MADV_SEQUENTIAL);
+        RecordFileHeader header;
+        std::memcpy(&header, this->base, sizeof(header));
+        if (std::memcmp(header.magic, kRecordMagic, sizeof(header.magic)) != 0 || header.version != kRecordVersion)
+        {
+            error = path + " is not a record log of version " + std::to_string(kRecordVersion);
+            return false;
+        }
+        return true;
+    }
+
+    size_t Size() const { return this->length; }
+
+    // Offset of the first record
+    static size_t Begin() { return sizeof(RecordFileHeader); }
+
+    /* Read the record at offset and advance offset to the next one.
+    *  \return: false at the end of the file or at a cut off record
+     */
+    bool Next(size_t& offset, RecordView& record) const
+    {
+        if (offset + sizeof(RecordHeader) > this->length) {return false;}
+        RecordHeader header;
+        std::memcpy(&header, this->base + offset, sizeof(header));
+        if (offset + sizeof(header) + header.size > this->length) {return false;}
+        record.type = (RecordType)header.type;
+        record.sequence = header.sequence;
+        record.offset = offset;
+        record.data = this->base + offset + sizeof(header);
+        record.size = header.size;
+        offset += sizeof(header) + header.size;
+        return true;
+    }
+
+private:
+    const uint8_t* base = nullptr;
+    size_t length = 0;
+};
+
+#endif // RECORD_LOG_H
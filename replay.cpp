@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "planner.h"
+#include "record_log.h"
+
+using namespace std;
+/**
+ * Replay of a record log (record_log.h) written by client_controller --record or
+ * headless_sim --record. The log is memory-mapped, every recorded command is planned again on
+ * the world state it was planned on and the new velocity is compared bit-for-bit with the
+ * recorded one. The planner is reset whenever the round of the commands changes, like the
+ * controller does, so the rounds are independent and are replayed in parallel on all cores.
+ *
+ * Usage: replay LOG [--threads N] [--mode reference|kernel|search|qp|analytic]
+ *                   [--conflict prior|occupancy|sampled] [--samples M] [--kernel runtime|fixed] [--show N]
+ * Exits with 2 if any command differs from the recording.
+ */
+
+// A recorded command with the world state it was planned on
+struct ReplayCommand
+{
+    size_t state_offset;                            // Offset of the world state record in the log
+    int32_t simulation_round;
+    double ego_car_speed;
+};
+
+// A command that came out different in the replay
+struct Mismatch
+{
+    size_t offset;                                  // Offset of the world state record in the log
+    int32_t simulation_round;
+    double recorded;
+    double replayed;
+};
+
+int main(int _argc, char **_argv)
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    string path;
+    unsigned num_threads = std::max(1u, thread::hardware_concurrency());
+    PlannerMode mode = PlannerMode::Kernel;
+    ConflictModel conflict = ConflictModel::PriorCar;
+    SampleParams sample;
+    bool fixed_kernel = true;
+    size_t show = 10;
+    for (int i = 1; i < _argc; i++)
+    {
+        const char* arg = _argv[i];
+        if (strncmp(arg, "--", 2) != 0) {path = arg; continue;}
+        const char* value = (i + 1 < _argc) ? _argv[i + 1] : nullptr;
+        if (value == nullptr) {cerr << "Missing value for " << arg << endl; return 1;}
+        if (!strcmp(arg, "--threads")) {num_threads = std::max(1, atoi(value));}
+        else if (!strcmp(arg, "--show")) {show = (size_t)std::max(0, atoi(value));}
+        else if (!strcmp(arg, "--mode"))
+        {
+            if (!strcmp(value, "reference")) {mode = PlannerMode::Reference;}
+            else if (!strcmp(value, "kernel")) {mode = PlannerMode::Kernel;}
+            else if (!strcmp(value, "search")) {mode = PlannerMode::JerkSearch;}
+            else if (!strcmp(value, "qp")) {mode = PlannerMode::Qp;}
+            else if (!strcmp(value, "analytic")) {mode = PlannerMode::Analytic;}
+            else {cerr << "Unknown mode " << value << endl; return 1;}
+        }
+        else if (!strcmp(arg, "--conflict"))
+        {
+            if (!strcmp(value, "prior")) {conflict = ConflictModel::PriorCar;}
+            else if (!strcmp(value, "occupancy")) {conflict = ConflictModel::Occupancy;}
+            else if (!strcmp(value, "sampled")) {conflict = ConflictModel::Sampled;}
+            else {cerr << "Unknown conflict model " << value << endl; return 1;}
+        }
+        else if (!strcmp(arg, "--samples")) {sample.samples = std::max(1, atoi(value));}
+        else if (!strcmp(arg, "--kernel"))
+        {
+            if (!strcmp(value, "runtime")) {fixed_kernel = false;}
+            else if (!strcmp(value, "fixed")) {fixed_kernel = true;}
+            else {cerr << "Unknown kernel " << value << endl; return 1;}
+        }
+        else {cerr << "Unknown argument " << arg << endl; return 1;}
+        i++;
+    }
+    if (path.empty()) {cerr << "Usage: replay LOG [--threads N] [--mode M] [--conflict C] [--samples M] [--kernel K] [--show N]" << endl; return 1;}
+
+    MappedLog log;
+    string error;
+    if (!log.Open(path, error)) {cerr << error << endl; return 1;}
+
+    // Index the world states and collect the commands with their world states
+    auto wall_start = chrono::steady_clock::now();
+    unordered_map<uint64_t, size_t> states;
+    vector<ReplayCommand> commands;
+    long num_statistics = 0, success = 0, collision = 0, orphans = 0;
+    custom_messages::Command command_msg;
+    custom_messages::Statistics statistics_msg;
+    RecordView record;
+    size_t offset = MappedLog::Begin();
+    while (log.Next(offset, record))
+    {
+        switch (record.type)
+        {
+            case RecordType::WorldState:
+                states[record.sequence] = record.offset;
+                break;
+            case RecordType::Command:
+            {
+                auto state = states.find(record.sequence);
+                if (state == states.end() || !record.Parse(command_msg)) {orphans++; break;}
+                commands.push_back({ state->second, command_msg.simulation_round(), command_msg.ego_car_speed() });
+                break;
+            }
+            case RecordType::Statistics:
+                if (!record.Parse(statistics_msg)) {break;}
+                num_statistics++;
+                success += statistics_msg.success() ? 1 : 0;
+                collision += statistics_msg.collision_detected() ? 1 : 0;
+                break;
+        }
+    }
+    if (offset != log.Size()) {cerr << "Ignoring " << log.Size() - offset << " bytes cut off at the end of the log" << endl;}
+
+    // Split the commands into runs of the same round, the planner starts over for each of them
+    vector<size_t> segments;
+    for (size_t c = 0; c < commands.size(); c++)
+    {
+        if (c == 0 || commands[c].simulation_round != commands[c - 1].simulation_round) {segments.push_back(c);}
+    }
+    segments.push_back(commands.size());
+    double index_time = chrono::duration<double>(chrono::steady_clock::now() - wall_start).count();
+
+    atomic<size_t> next_segment(0);
+    vector<vector<Mismatch>> mismatches(num_threads);
+    vector<long> corrupt(num_threads, 0);
+    vector<thread> workers;
+    auto replay_start = chrono::steady_clock::now();
+    for (unsigned w = 0; w < num_threads; w++)
+    {
+        workers.emplace_back([&, w]()
+        {
+            Planner planner(mode);
+            planner.SetConflictModel(conflict);
+            planner.Sampler().SetParams(sample);
+            if (!fixed_kernel) {planner.SetKernelProfile(KernelProfile::Runtime);}
+            custom_messages::WorldState msg;
+            RecordView state;
+            for (size_t s = next_segment++; s + 1 < segments.size(); s = next_segment++)
+            {
+                planner.Reset();
+                for (size_t c = segments[s]; c < segments[s + 1]; c++)
+                {
+                    const ReplayCommand& command = commands[c];
+                    size_t state_offset = command.state_offset;
+                    if (!log.Next(state_offset, state) || !state.Parse(msg)) {corrupt[w]++; continue;}
+                    const double speed = planner.Plan(msg);
+                    if (speed != command.ego_car_speed)
+                    {
+                        mismatches[w].push_back({ command.state_offset, command.simulation_round, command.ego_car_speed, speed });
+                    }
+                }
+            }
+        });
+    }
+    for (thread& worker : workers) {worker.join();}
+    double replay_time = chrono::duration<double>(chrono::steady_clock::now() - replay_start).count();
+
+    vector<Mismatch> all;
+    long num_corrupt = 0;
+    for (unsigned w = 0; w < num_threads; w++)
+    {
+        all.insert(all.end(), mismatches[w].begin(), mismatches[w].end());
+        num_corrupt += corrupt[w];
+    }
+    sort(all.begin(), all.end(), [](const Mismatch& a, const Mismatch& b) {return a.offset < b.offset;});
+    cout << "Log: " << log.Size() << " bytes, " << states.size() << " world states, " << commands.size() << " commands, "
+         << num_statistics << " statistics (" << success << " success, " << collision << " collision)" << endl
+         << "Rounds: " << segments.size() - 1 << " replayed on " << num_threads << " threads" << endl
+         << "Indexed in " << index_time << " s, replayed in " << replay_time << " s ("
+         << commands.size() / std::max(replay_time, 1e-9) << " ticks/s)" << endl;
+    if (orphans > 0) {cout << "Commands without their world state: " << orphans << endl;}
+    if (num_corrupt > 0) {cout << "World states that could not be parsed: " << num_corrupt << endl;}
+    cout << "Commands different from the recording: " << all.size() << endl;
+    for (size_t i = 0; i < std::min(show, all.size()); i++)
+    {
+        cout << setprecision(17) << "  round " << all[i].simulation_round << " at offset " << all[i].offset << ": recorded "
+             << all[i].recorded << ", replayed " << all[i].replayed << endl;
+    }
+
+    google::protobuf::ShutdownProtobufLibrary();
+    return all.empty() ? 0 : 2;
+}
@@ -0,0 +1,292 @@
+#ifndef SAMPLED_PREDICTION_H
+#define SAMPLED_PREDICTION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "thread_pool.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Uncertainty-aware prediction of the cars crossing the ego path. Instead of the single
+ * constant-acceleration trajectory of the prior car, every relevant car gets M sampled
+ * trajectories: the velocity and the acceleration are drawn around the measured ones, and a
+ * sample brakes hard from a random step of the horizon with brake_probability, as the cars of
+ * the simulator do when the car in front of them slows down. A sampled car never reverses.
+ * Sample m of the scene is sample m of every car, and the result is one bitset over the
+ * samples per step of the horizon: bit m of step k is set if any car of sample m is near the
+ * intersection at step k. From it the kernel gets the fraction of samples occupying the
+ * intersection at every step and, for the steps a candidate is near the intersection, the
+ * probability that it meets a car in at least one of them: the union of the bitsets of
+ * these steps, counted. Both are word operations over M/64 words, so scoring a candidate
+ * against hundreds of samples costs a few hundred instructions.
+ * The samples are generated 4 at a time in AVX2 registers (scalar fallback without AVX2), in
+ * chunks of 64 samples that write their own word of every step, and the chunks are spread
+ * over a thread pool when there is one. The random draws of a chunk only depend on the seed,
+ * the stream of the tick and the chunk, so the result does not depend on the number of threads.
+ */
+
+// Parameters of the sampled prediction
+struct SampleParams
+{
+    int samples = 256;                              // Sampled trajectories per car, rounded up to a multiple of 64
+    double vel_sigma = 0.5;                         // Standard deviation of the sampled velocity in m/s
+    double acc_sigma = 0.5;                         // Standard deviation of the sampled acceleration in m/s^2
+    double brake_probability = 0.1;                 // Probability that a sampled car brakes within the horizon
+    double brake_acc = -6.0;                        // Acceleration of a braking sample in m/s^2
+    double near = 5.0;                              // Half size of the intersection box, the near test of the kernel
+    double Cp = 1e5;                                // Factor for the collision probability term in cost function
+    int task_samples = 256;                         // Samples per pool task, a multiple of 64
+    uint64_t seed = 1;
+};
+
+class SampledPrediction {
+
+public:
+    /* Constructor
+    *  \param[in]: K Number of steps for prediction horizon
+    *  \param[in]: dt Time step in seconds
+    *  \param[in]: sample The number of samples and the noise model
+    *  \param[in]: pool Optional thread pool the chunks of samples are spread over, not owned
+     */
+    SampledPrediction(int K, float dt, const SampleParams& sample = SampleParams(), ThreadPool* pool = nullptr)
+        : K(K), dt(dt), pool(pool)
+    {
+        this->cars.reserve(64);
+        SetParams(sample);
+    }
+
+    // Change the number of samples or the noise model, allocates
+    void SetParams(const SampleParams& sample)
+    {
+        this->sample = sample;
+        this->sample.task_samples = std::max(64, sample.task_samples / 64 * 64);
+        this->words = std::max(1, (sample.samples + 63) / 64);
+        this->occupied.assign((size_t)this->K * this->words, 0);
+        this->near_fraction.assign(this->K, 0.0);
+    }
+
+    const SampleParams& Params() const { return this->sample; }
+    int Samples() const { return 64 * this->words; }
+
+    // Remove all cars
+    void Clear() { this->cars.clear(); }
+
+    /* Add a car crossing the ego path, along the y axis.
+    *  \param[in]: pos, vel, acc The measured position, velocity and acceleration along its lane
+     */
+    void Add(double pos, double vel, double acc)
+    {
+        this->cars.push_back(Car{ pos, vel, acc });
+    }
+
+    /* Sample all cars over the horizon and count the samples near the intersection per step.
+    *  \param[in]: stream Distinguishes the ticks, the same stream gives the same samples
+     */
+    void Sample(uint64_t stream)
+    {
+        const int task_words = this->sample.task_samples / 64;
+        if (this->pool == nullptr || this->words <= task_words)
+        {
+            SampleWords(0, this->words, stream);
+        }
+        else
+        {
+            TaskGroup group(this->pool);
+            for (int w = task_words; w < this->words; w += task_words)
+            {
+                const int end = std::min(this->words, w + task_words);
+                group.Run([this, w, end, stream]() {SampleWords(w, end, stream);});
+            }
+            SampleWords(0, task_words, stream);
+            group.Wait();
+        }
+        const double scale = 1.0 / Samples();
+        for (int k = 0; k < this->K; k++)
+        {
+            int count = 0;
+            const uint64_t* step = &this->occupied[(size_t)k * this->words];
+            for (int w = 0; w < this->words; w++) {count += __builtin_popcountll(step[w]);}
+            this->near_fraction[k] = count * scale;
+        }
+    }
+
+    // Fraction of the samples with a car near the intersection at step k
+    double NearFraction(int k) const { return this->near_fraction[k]; }
+
+    /* Probability that the ego car meets a car in at least one of the steps it is near the
+    *  intersection, over the samples of the last Sample.
+    *  \param[in]: ego_steps Bit k set if the ego car is near the intersection at step k, (K + 63) / 64 words
+     */
+    double CollisionProbability(const uint64_t* ego_steps) const
+    {
+        const int step_words = (this->K + 63) / 64;
+        int count = 0;
+        for (int w = 0; w < this->words; w++)
+        {
+            uint64_t hit = 0;
+            for (int s = 0; s < step_words; s++)
+            {
+                for (uint64_t bits = ego_steps[s]; bits != 0; bits &= bits - 1)
+                {
+                    const int k = 64 * s + __builtin_ctzll(bits);
+                    hit |= this->occupied[(size_t)k * this->words + w];
+                }
+            }
+            count += __builtin_popcountll(hit);
+        }
+        return count / (double)Samples();
+    }
+
+private:
+    // A measured car
+    struct Car
+    {
+        double pos, vel, acc;
+    };
+
+    // Random source of a chunk, splitmix64
+    struct Random
+    {
+        uint64_t state;
+
+        uint64_t Next()
+        {
+            uint64_t z = (this->state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        // Uniform in [0, 1)
+        double Uniform() { return (Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+        // Two standard normals from Box-Muller, truncated to kMaxSigma
+        void Normals(double& n0, double& n1)
+        {
+            const double radius = std::sqrt(-2.0 * std::log(1.0 - Uniform()));
+            const double angle = 6.283185307179586 * Uniform();
+            n0 = std::max(-kMaxSigma, std::min((double)kMaxSigma, radius * std::cos(angle)));
+            n1 = std::max(-kMaxSigma, std::min((double)kMaxSigma, radius * std::sin(angle)));
+        }
+    };
+
+    static constexpr double kMaxSigma = 4.0;        // The normal draws are cut off here, bounds the reach of a car
+
+    // Sample the 64 samples of every word in [begin, end) for all cars
+    void SampleWords(int begin, int end, uint64_t stream)
+    {
+        for (int w = begin; w < end; w++)
+        {
+            for (int k = 0; k < this->K; k++) {this->occupied[(size_t)k * this->words + w] = 0;}
+            for (size_t c = 0; c < this->cars.size(); c++)
+            {
+                Random random = { this->sample.seed ^ (stream * 0xD6E8FEB86659FD93ull) ^ ((uint64_t)w << 32) ^ (uint64_t)c };
+                random.Next();
+                SampleCar(this->cars[c], w, random);
+            }
+        }
+    }
+
+    /* Draw the 64 samples of a car in word w and set their bits in the steps they are near
+    *  the intersection. The motion is along the direction of travel, so stopping is speed 0.
+    *  A car that cannot reach the intersection even with the largest draws is skipped, and the
+    *  horizon of 4 samples ends once all of them have left the intersection.
+     */
+    void SampleCar(const Car& car, int w, Random& random)
+    {
+        const double direction = (car.vel < 0) ? -1.0 : 1.0;
+        const double start = direction * car.pos;      // Signed distance travelled past the centre
+        const double horizon = this->K * this->dt;
+        const double max_speed = std::abs(car.vel) + kMaxSigma * this->sample.vel_sigma;
+        const double max_acc = std::max(0.0, direction * car.acc + kMaxSigma * this->sample.acc_sigma);
+        if (start >= this->sample.near || start + max_speed * horizon + 0.5 * max_acc * horizon * horizon <= -this->sample.near)
+        {
+            return;
+        }
+        const double K = this->K;
+        alignas(32) double pos[64], speed[64], acc[64], stop_factor[64], brake_step[64];
+        for (int s = 0; s < 64; s++)
+        {
+            double n0, n1;
+            random.Normals(n0, n1);
+            pos[s] = start;
+            speed[s] = std::max(0.0, std::abs(car.vel) + this->sample.vel_sigma * n0);
+            acc[s] = direction * car.acc + this->sample.acc_sigma * n1;
+            stop_factor[s] = -0.5 / acc[s];
+            brake_step[s] = (random.Uniform() < this->sample.brake_probability) ? std::floor(random.Uniform() * K) : K;
+        }
+        // The steps are the outer loop, so the 16 registers of a step are independent of each other
+        uint64_t* step_words = &this->occupied[w];
+        const double dt = this->dt;
+#if defined(__AVX2__)
+        const __m256d near = _mm256_set1_pd(this->sample.near);
+        const __m256d sign = _mm256_set1_pd(-0.0);
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d dt_v = _mm256_set1_pd(dt);
+        const __m256d half_dt_sq = _mm256_set1_pd(0.5 * dt * dt);
+        const __m256d brake = _mm256_set1_pd(this->sample.brake_acc);
+        const __m256d brake_stop_factor = _mm256_set1_pd(-0.5 / this->sample.brake_acc);
+        for (int k = 0; k < this->K; k++)
+        {
+            const __m256d kk = _mm256_set1_pd((double)k);
+            uint64_t near_bits = 0, past_bits = 0;
+            for (int s = 0; s < 64; s += 4)
+            {
+                const __m256d p = _mm256_load_pd(&pos[s]);
+                const __m256d u = _mm256_load_pd(&speed[s]);
+                const __m256d is_near = _mm256_cmp_pd(_mm256_andnot_pd(sign, p), near, _CMP_LT_OQ);
+                near_bits |= (uint64_t)_mm256_movemask_pd(is_near) << s;
+                past_bits |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(p, near, _CMP_GE_OQ)) << s;
+                // Advance by one step, a sample that would reverse stops where its speed reaches 0
+                const __m256d braking = _mm256_cmp_pd(kk, _mm256_load_pd(&brake_step[s]), _CMP_GE_OQ);
+                const __m256d a = _mm256_blendv_pd(_mm256_load_pd(&acc[s]), brake, braking);
+                const __m256d u_next = _mm256_add_pd(u, _mm256_mul_pd(a, dt_v));
+                const __m256d stops = _mm256_cmp_pd(u_next, zero, _CMP_LT_OQ);
+                const __m256d moved = _mm256_add_pd(_mm256_mul_pd(u, dt_v), _mm256_mul_pd(a, half_dt_sq));
+                // Distance to the stop -u^2 / (2 a), with the factor of the acceleration precomputed
+                const __m256d factor = _mm256_blendv_pd(_mm256_load_pd(&stop_factor[s]), brake_stop_factor, braking);
+                const __m256d to_stop = _mm256_mul_pd(_mm256_mul_pd(u, u), factor);
+                _mm256_store_pd(&pos[s], _mm256_add_pd(p, _mm256_blendv_pd(moved, to_stop, stops)));
+                _mm256_store_pd(&speed[s], _mm256_blendv_pd(u_next, zero, stops));
+            }
+            step_words[(size_t)k * this->words] |= near_bits;
+            if (past_bits == ~0ULL) {break;}
+        }
+#else
+        // The same expressions as the AVX2 lanes, so both paths sample the same trajectories
+        const double half_dt_sq = 0.5 * dt * dt;
+        const double brake_stop_factor = -0.5 / this->sample.brake_acc;
+        for (int k = 0; k < this->K; k++)
+        {
+            uint64_t near_bits = 0, past_bits = 0;
+            for (int s = 0; s < 64; s++)
+            {
+                if (std::abs(pos[s]) < this->sample.near) {near_bits |= 1ULL << s;}
+                if (pos[s] >= this->sample.near) {past_bits |= 1ULL << s;}
+                const bool braking = (double)k >= brake_step[s];
+                const double a = braking ? this->sample.brake_acc : acc[s];
+                const double u_next = speed[s] + a * dt;
+                if (u_next < 0) {pos[s] += (speed[s] * speed[s]) * (braking ? brake_stop_factor : stop_factor[s]); speed[s] = 0.0;}
+                else {pos[s] += speed[s] * dt + a * half_dt_sq; speed[s] = u_next;}
+            }
+            step_words[(size_t)k * this->words] |= near_bits;
+            if (past_bits == ~0ULL) {break;}
+        }
+#endif
+    }
+
+    const int K;                                    // Number of steps for prediction horizon
+    const double dt;                                // Time step in seconds
+    ThreadPool* const pool;                         // Runs the chunks of samples, not owned
+    SampleParams sample;
+    int words;                                      // 64 bit words of sample bits per step
+    std::vector<Car> cars;                          // The cars of the current tick
+    std::vector<uint64_t> occupied;                 // Per step, bit m set if a car of sample m is near the intersection
+    std::vector<double> near_fraction;              // Per step, the fraction of samples with bit set
+};
+
+#endif // SAMPLED_PREDICTION_H
@@ -0,0 +1,59 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+static const size_t kCacheLine = 64;                // Cache line size of the x86 cores we run on
+
+/**
+ * Fixed number of objects in one contiguous allocation, every object starting on its own
+ * cache line and padded to a whole number of cache lines, so threads working on different
+ * objects never write to the same line. The objects are built in place and never move, they
+ * can hand out pointers to themselves (callbacks, tasks). Operator new only guarantees
+ * over-aligned storage from C++17 on, so the storage is taken from posix_memalign.
+ */
+template <class T>
+class Slab {
+
+public:
+    static const size_t kStride = (sizeof(T) + kCacheLine - 1) / kCacheLine * kCacheLine; // Bytes per object
+
+    /* Constructor, build count objects with T(index, args...)
+    *  \param[in]: count Number of objects
+    *  \param[in]: args Passed to the constructor of every object after its index
+     */
+    template <class... Args>
+    explicit Slab(size_t count, Args&&... args)
+    {
+        void* storage = nullptr;
+        if (count > 0 && posix_memalign(&storage, kCacheLine, count * kStride) != 0) {throw std::bad_alloc();}
+        this->base = static_cast<char*>(storage);
+        for (; this->count < count; this->count++)
+        {
+            new (this->base + this->count * kStride) T(this->count, args...);
+        }
+    }
+
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+
+    // Destroy the objects in the reverse order of construction
+    ~Slab()
+    {
+        while (this->count > 0) {(*this)[--this->count].~T();}
+        std::free(this->base);
+    }
+
+    size_t Size() const { return this->count; }
+    T& operator[](size_t i) { return *reinterpret_cast<T*>(this->base + i * kStride); }
+    const T& operator[](size_t i) const { return *reinterpret_cast<const T*>(this->base + i * kStride); }
+
+private:
+    char* base = nullptr;
+    size_t count = 0;                               // Objects constructed so far
+};
+
+#endif // SLAB_H
@@ -0,0 +1,203 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Work-stealing thread pool. Every worker owns a task deque, tasks submitted from a worker go
+ * to its own deque and are taken back in LIFO order, so a recursive search stays depth first
+ * and cache friendly. Idle workers steal the oldest task (the biggest subtree) from the others.
+ * Threads waiting for a TaskGroup help running tasks instead of blocking, so groups can be
+ * nested and the pool can be shared by several planners.
+ */
+class ThreadPool {
+
+public:
+    typedef std::function<void()> Task;
+
+    // Constructor, start num_threads workers, one per core by default
+    explicit ThreadPool(unsigned num_threads = std::thread::hardware_concurrency())
+    {
+        if (num_threads == 0) {num_threads = 1;}
+        for (unsigned i = 0; i < num_threads; i++)
+        {
+            this->queues.emplace_back(new Queue());
+        }
+        for (unsigned i = 0; i < num_threads; i++)
+        {
+            this->workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->idle_mutex);
+            this->stop = true;
+        }
+        this->idle_cv.notify_all();
+        for (std::thread& worker : this->workers) {worker.join();}
+    }
+
+    unsigned Size() const { return (unsigned)this->workers.size(); }
+
+    /* Queue a task. From a worker of this pool it goes to the worker's own deque,
+    *  from any other thread the deques are filled round-robin.
+     */
+    void Submit(Task task)
+    {
+        int index = CurrentWorker();
+        if (index < 0) {index = (int)(this->next_queue++ % this->queues.size());}
+        {
+            std::lock_guard<std::mutex> lock(this->queues[index]->mutex);
+            this->queues[index]->tasks.push_back(std::move(task));
+            this->pending++;
+        }
+        // Take the idle lock once, so a worker cannot miss the wake up between its check and its wait
+        { std::lock_guard<std::mutex> lock(this->idle_mutex); }
+        this->idle_cv.notify_one();
+    }
+
+    /* Run one queued task on the calling thread, taking its own newest task first and
+    *  stealing the oldest task of another worker otherwise.
+    *  \return: false if there was no task to run
+     */
+    bool RunPending()
+    {
+        Task task;
+        if (!Take(CurrentWorker(), task)) {return false;}
+        task();
+        return true;
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // Index of the calling thread in this pool, -1 if it is not one of its workers
+    int CurrentWorker() const
+    {
+        return (Current().pool == this) ? Current().index : -1;
+    }
+
+    struct WorkerId
+    {
+        const ThreadPool* pool;
+        int index;
+    };
+
+    static WorkerId& Current()
+    {
+        static thread_local WorkerId id = { nullptr, -1 };
+        return id;
+    }
+
+    bool Take(int self, Task& task)
+    {
+        const int n = (int)this->queues.size();
+        if (self >= 0)
+        {
+            Queue& own = *this->queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                this->pending--;
+                return true;
+            }
+        }
+        int start = (self >= 0) ? self + 1 : 0;
+        for (int i = 0; i < n; i++)
+        {
+            Queue& victim = *this->queues[(start + i) % n];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                this->pending--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WorkerLoop(int index)
+    {
+        Current().pool = this;
+        Current().index = index;
+        while (true)
+        {
+            Task task;
+            if (Take(index, task))
+            {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(this->idle_mutex);
+            this->idle_cv.wait(lock, [this]() {return this->stop || this->pending > 0;});
+            if (this->stop && this->pending == 0) {return;}
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<Queue>> queues;     // One task deque per worker
+    std::vector<std::thread> workers;
+    std::atomic<long> pending{0};                   // Number of queued tasks over all deques
+    std::atomic<unsigned> next_queue{0};            // Round-robin index for tasks from outside the pool
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;                // Wakes up idle workers when tasks are queued
+    bool stop = false;
+};
+
+/**
+ * A set of tasks that can be waited for. Without a pool the tasks run inline.
+ */
+class TaskGroup {
+
+public:
+    explicit TaskGroup(ThreadPool* pool) : pool(pool) {}
+
+    ~TaskGroup() { Wait(); }
+
+    void Run(ThreadPool::Task task)
+    {
+        if (this->pool == nullptr)
+        {
+            task();
+            return;
+        }
+        this->outstanding++;
+        this->pool->Submit([this, task]()
+        {
+            task();
+            this->outstanding--;
+        });
+    }
+
+    // Wait until all tasks of the group are done, running queued tasks in the meantime
+    void Wait()
+    {
+        while (this->outstanding > 0)
+        {
+            if (!this->pool->RunPending()) {std::this_thread::yield();}
+        }
+    }
+
+private:
+    ThreadPool* pool;
+    std::atomic<long> outstanding{0};               // Tasks submitted but not finished yet
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "episode.h"
+#include "thread_pool.h"
+
+using namespace std;
+/**
+ * Parameter sweep and auto-tuning of the planner. Every parameter set is run over the same
+ * seeded episodes of the in-process world (world_sim.h), all sets and episodes are spread over
+ * a work-stealing pool as chunks of episodes. The parameter sets are the product of a grid, a
+ * random sample, or an adaptive successive halving: many random sets are run on a few episodes,
+ * the better half by Pareto rank is kept and run on twice as many episodes, until one set is
+ * left or the episode budget is reached. The result is the Pareto front of success rate,
+ * collision rate, time steps of successful episodes and total acceleration, the same metrics
+ * as custom_messages::Statistics. The deployed parameters always take part as set 0.
+ *
+ * Usage: tune [--strategy grid|random|adaptive] [--configs N] [--grid-points N] [--episodes N]
+ *             [--max-episodes N] [--threads N] [--seed N] [--chunk N] [--mode reference|kernel|analytic]
+ *             [--cv LO:HI] [--ca LO:HI] [--yield-line LO:HI] [--margin LO:HI]
+ *             [--vel-target LO:HI] [--jerk LO:HI] [--candidates LO:HI] [--csv FILE]
+ *             [--min-vehicles N] [--max-vehicles N] [--lanes 123] [--arrival-rate P]
+ * A range with LO equal to HI (or a single value) keeps that parameter fixed.
+ */
+
+// Range of one tuned parameter
+struct TuneRange
+{
+    const char* name;
+    double lo, hi;
+    bool integer;                                   // Only odd integers, for the number of jerk candidates
+};
+
+enum TuneDimension { kCv, kCa, kYieldLine, kMargin, kVelTarget, kJerk, kCandidates, kDimensions };
+
+// A parameter set and its results over all episodes run so far
+struct Candidate
+{
+    int id;
+    double values[kDimensions];
+    EpisodeTotals totals;
+    int front = 0;                                  // Pareto front of the last ranking, 0 is the best
+};
+
+/* The planner parameters of a set, the jerk candidates are spread evenly over [-jerk, jerk].
+*  Set 0 keeps the jerk list of the deployed planner.
+ */
+MpcParams ToParams(const Candidate& candidate)
+{
+    MpcParams params;
+    params.Cv = candidate.values[kCv];
+    params.Ca = candidate.values[kCa];
+    params.yield_line = candidate.values[kYieldLine];
+    params.margin = candidate.values[kMargin];
+    params.vel_target = candidate.values[kVelTarget];
+    if (candidate.id == 0) {return params;}
+    const int n = (int)candidate.values[kCandidates];
+    params.da_list.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        params.da_list[i] = (float)(candidate.values[kJerk] * (n > 1 ? -1.0 + 2.0 * i / (n - 1) : 0.0));
+    }
+    return params;
+}
+
+// Rates and means of the results of a set
+double SuccessRate(const EpisodeTotals& t) { return double(t.success) / std::max(1L, t.episodes); }
+double CollisionRate(const EpisodeTotals& t) { return double(t.collision) / std::max(1L, t.episodes); }
+double SuccessSteps(const EpisodeTotals& t) { return t.success > 0 ? double(t.success_time_steps) / t.success : 1e9; }
+double MeanAcceleration(const EpisodeTotals& t) { return t.total_acceleration / std::max(1L, t.episodes); }
+
+// If a is at least as good as b in all metrics and better in one
+bool Dominates(const EpisodeTotals& a, const EpisodeTotals& b)
+{
+    const double ma[4] = { -SuccessRate(a), CollisionRate(a), SuccessSteps(a), MeanAcceleration(a) };
+    const double mb[4] = { -SuccessRate(b), CollisionRate(b), SuccessSteps(b), MeanAcceleration(b) };
+    bool better = false;
+    for (int m = 0; m < 4; m++)
+    {
+        if (ma[m] > mb[m]) {return false;}
+        better |= ma[m] < mb[m];
+    }
+    return better;
+}
+
+// Assign the Pareto front of every set by non-dominated sorting, then sort by front and success rate
+void RankPareto(vector<Candidate>& candidates)
+{
+    const size_t n = candidates.size();
+    vector<int> dominated_by(n, 0);
+    vector<vector<int>> dominates(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t j = i + 1; j < n; j++)
+        {
+            if (Dominates(candidates[i].totals, candidates[j].totals)) {dominates[i].push_back((int)j); dominated_by[j]++;}
+            else if (Dominates(candidates[j].totals, candidates[i].totals)) {dominates[j].push_back((int)i); dominated_by[i]++;}
+        }
+    }
+    vector<int> current;
+    for (size_t i = 0; i < n; i++) {if (dominated_by[i] == 0) {current.push_back((int)i);}}
+    for (int front = 0; !current.empty(); front++)
+    {
+        vector<int> next;
+        for (int i : current)
+        {
+            candidates[i].front = front;
+            for (int j : dominates[i]) {if (--dominated_by[j] == 0) {next.push_back(j);}}
+        }
+        current.swap(next);
+    }
+    sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b)
+    {
+        if (a.front != b.front) {return a.front < b.front;}
+        return SuccessRate(a.totals) > SuccessRate(b.totals);
+    });
+}
+
+/* Run the episodes [first_episode, first_episode + episodes) for every set on the pool and add
+*  the results to the sets. All sets see the same seeds.
+ */
+void Evaluate(vector<Candidate>& candidates, long first_episode, long episodes, long chunk, PlannerMode mode,
+              const SimConfig& config, uint64_t seed, ThreadPool& pool)
+{
+    const long chunks_per_set = (episodes + chunk - 1) / chunk;
+    vector<EpisodeTotals> results(candidates.size() * chunks_per_set);
+    {
+        TaskGroup group(&pool);
+        for (size_t c = 0; c < candidates.size(); c++)
+        {
+            const MpcParams params = ToParams(candidates[c]);
+            for (long k = 0; k < chunks_per_set; k++)
+            {
+                EpisodeTotals* result = &results[c * chunks_per_set + k];
+                group.Run([=, &config]()
+                {
+                    Planner planner(mode, nullptr, params);
+                    long mismatches = 0;
+                    const long begin = first_episode + k * chunk;
+                    const long end = std::min(first_episode + episodes, begin + chunk);
+                    for (long i = begin; i < end; i++)
+                    {
+                        result->Add(RunEpisode(planner, nullptr, mismatches, nullptr, config, seed + i, (int32_t)(i + 1)));
+                    }
+                });
+            }
+        }
+    }
+    for (size_t c = 0; c < candidates.size(); c++)
+    {
+        for (long k = 0; k < chunks_per_set; k++) {candidates[c].totals.Add(results[c * chunks_per_set + k]);}
+    }
+}
+
+void PrintCandidates(ostream& out, const vector<Candidate>& candidates, const TuneRange* ranges, bool only_front)
+{
+    out << setw(6) << "id";
+    for (int d = 0; d < kDimensions; d++) {out << setw(12) << ranges[d].name;}
+    out << setw(10) << "episodes" << setw(10) << "success" << setw(10) << "collision" << setw(10) << "steps"
+        << setw(10) << "accel" << setw(7) << "front" << endl;
+    for (const Candidate& c : candidates)
+    {
+        if (only_front && c.front > 0) {continue;}
+        out << setw(6) << c.id << fixed << setprecision(3);
+        for (int d = 0; d < kDimensions; d++)
+        {
+            if (ranges[d].integer) {out << setw(12) << (int)c.values[d];}
+            else {out << setw(12) << c.values[d];}
+        }
+        out << setw(10) << c.totals.episodes << setprecision(2)
+            << setw(9) << 100.0 * SuccessRate(c.totals) << "%" << setw(9) << 100.0 * CollisionRate(c.totals) << "%"
+            << setw(10) << SuccessSteps(c.totals) << setw(10) << MeanAcceleration(c.totals) << setw(7) << c.front << endl;
+        out.unsetf(ios::floatfield);
+    }
+}
+
+bool ParseRange(const char* value, TuneRange& range)
+{
+    char* end = nullptr;
+    range.lo = strtod(value, &end);
+    range.hi = (*end == ':') ? strtod(end + 1, &end) : range.lo;
+    if (range.hi < range.lo) {std::swap(range.lo, range.hi);}
+    return *end == '\0';
+}
+
+int main(int _argc, char **_argv)
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    const MpcParams deployed;
+    TuneRange ranges[kDimensions] = {
+        { "Cv", 0.25, 4.0, false },
+        { "Ca", 0.25, 8.0, false },
+        { "yield_line", -40.0, -10.0, false },
+        { "margin", -20.0, -2.0, false },
+        { "vel_target", 10.0, 20.0, false },
+        { "jerk", 0.05, 0.19, false },
+        { "candidates", 3, 9, true },
+    };
+    string strategy = "random";
+    long num_configs = 200;
+    int grid_points = 3;
+    long episodes = 200;
+    long max_episodes = 3200;
+    unsigned num_threads = std::max(1u, thread::hardware_concurrency());
+    uint64_t seed = 1;
+    long chunk = 50;
+    PlannerMode mode = PlannerMode::Kernel;
+    string csv_path;
+    SimConfig config;
+    for (int i = 1; i < _argc; i++)
+    {
+        const char* arg = _argv[i];
+        const char* value = (i + 1 < _argc) ? _argv[i + 1] : nullptr;
+        if (value == nullptr) {cerr << "Missing value for " << arg << endl; return 1;}
+        bool is_range = false;
+        for (int d = 0; d < kDimensions; d++)
+        {
+            string flag = string("--") + ranges[d].name;
+            for (char& c : flag) {c = (c == '_') ? '-' : (char)tolower(c);}
+            if (flag == arg)
+            {
+                if (!ParseRange(value, ranges[d])) {cerr << "Bad range " << value << " for " << arg << endl; return 1;}
+                is_range = true;
+            }
+        }
+        if (is_range) {}
+        else if (!strcmp(arg, "--strategy")) {strategy = value;}
+        else if (!strcmp(arg, "--configs")) {num_configs = std::max(1L, atol(value));}
+        else if (!strcmp(arg, "--grid-points")) {grid_points = std::max(1, atoi(value));}
+        else if (!strcmp(arg, "--episodes")) {episodes = std::max(1L, atol(value));}
+        else if (!strcmp(arg, "--max-episodes")) {max_episodes = std::max(1L, atol(value));}
+        else if (!strcmp(arg, "--threads")) {num_threads = std::max(1, atoi(value));}
+        else if (!strcmp(arg, "--seed")) {seed = strtoull(value, nullptr, 10);}
+        else if (!strcmp(arg, "--chunk")) {chunk = std::max(1L, atol(value));}
+        else if (!strcmp(arg, "--csv")) {csv_path = value;}
+        else if (!strcmp(arg, "--min-vehicles")) {config.min_vehicles = atoi(value);}
+        else if (!strcmp(arg, "--max-vehicles")) {config.max_vehicles = atoi(value);}
+        else if (!strcmp(arg, "--arrival-rate")) {config.arrival_rate = atof(value);}
+        else if (!strcmp(arg, "--mode"))
+        {
+            if (!strcmp(value, "reference")) {mode = PlannerMode::Reference;}
+            else if (!strcmp(value, "kernel")) {mode = PlannerMode::Kernel;}
+            else if (!strcmp(value, "analytic")) {mode = PlannerMode::Analytic;}
+            else {cerr << "Unknown mode " << value << endl; return 1;}
+        }
+        else if (!strcmp(arg, "--lanes"))
+        {
+            config.lane_mask = 0;
+            for (const char* c = value; *c; c++) {if (*c >= '1' && *c <= '3') {config.lane_mask |= 1 << (*c - '0');}}
+        }
+        else {cerr << "Unknown argument " << arg << endl; return 1;}
+        i++;
+    }
+    if (config.max_vehicles < config.min_vehicles) {config.max_vehicles = config.min_vehicles;}
+    // The jerk search keeps at most 16 candidates and the simulator allows a jerk of 0.2
+    ranges[kCandidates].lo = std::max(1.0, ranges[kCandidates].lo);
+    ranges[kCandidates].hi = std::min(15.0, ranges[kCandidates].hi);
+    ranges[kJerk].hi = std::min(0.19, ranges[kJerk].hi);
+
+    // Set 0 is the deployed planner
+    vector<Candidate> candidates(1);
+    candidates[0].id = 0;
+    const double deployed_values[kDimensions] = { deployed.Cv, deployed.Ca, deployed.yield_line, deployed.margin,
+                                                  deployed.vel_target, deployed.da_list.back(), (double)deployed.da_list.size() };
+    std::copy(deployed_values, deployed_values + kDimensions, candidates[0].values);
+    auto odd = [](double v) {int n = (int)std::lround(v); return (n % 2 == 0) ? n + 1 : n;};
+    if (strategy == "grid")
+    {
+        // All combinations of grid_points values per parameter that is not fixed
+        long total = 1;
+        for (int d = 0; d < kDimensions; d++) {total *= (ranges[d].lo < ranges[d].hi) ? grid_points : 1;}
+        for (long g = 0; g < total; g++)
+        {
+            Candidate candidate;
+            candidate.id = (int)candidates.size();
+            long index = g;
+            for (int d = 0; d < kDimensions; d++)
+            {
+                const int points = (ranges[d].lo < ranges[d].hi) ? grid_points : 1;
+                const int p = (int)(index % points);
+                index /= points;
+                double v = (points > 1) ? ranges[d].lo + (ranges[d].hi - ranges[d].lo) * p / (points - 1) : ranges[d].lo;
+                candidate.values[d] = ranges[d].integer ? odd(v) : v;
+            }
+            candidates.push_back(candidate);
+        }
+    }
+    else if (strategy == "random" || strategy == "adaptive")
+    {
+        mt19937_64 rng(seed);
+        for (long n = 0; n < num_configs; n++)
+        {
+            Candidate candidate;
+            candidate.id = (int)candidates.size();
+            for (int d = 0; d < kDimensions; d++)
+            {
+                double v = uniform_real_distribution<double>(ranges[d].lo, ranges[d].hi)(rng);
+                candidate.values[d] = ranges[d].integer ? odd(v) : v;
+            }
+            candidates.push_back(candidate);
+        }
+    }
+    else {cerr << "Unknown strategy " << strategy << endl; return 1;}
+
+    ThreadPool pool(num_threads);
+    auto wall_start = chrono::steady_clock::now();
+    vector<Candidate> evaluated;                    // Sets dropped by the adaptive search with their results
+    long first_episode = 0;
+    long round_episodes = episodes;
+    while (true)
+    {
+        Evaluate(candidates, first_episode, round_episodes, chunk, mode, config, seed, pool);
+        first_episode += round_episodes;
+        RankPareto(candidates);
+        cout << "Ran " << candidates.size() << " parameter sets on " << first_episode << " episodes each, "
+             << chrono::duration<double>(chrono::steady_clock::now() - wall_start).count() << " s" << endl;
+        if (strategy != "adaptive" || candidates.size() <= 1 || first_episode * 2 > max_episodes) {break;}
+        // Keep the better half, the deployed set always stays for comparison
+        size_t keep = (candidates.size() + 1) / 2;
+        for (size_t c = keep; c < candidates.size(); c++)
+        {
+            if (candidates[c].id == 0) {std::swap(candidates[c], candidates[keep++]);}
+        }
+        evaluated.insert(evaluated.end(), candidates.begin() + keep, candidates.end());
+        candidates.resize(keep);
+        round_episodes = first_episode;
+    }
+
+    cout << endl << "Pareto front:" << endl;
+    PrintCandidates(cout, candidates, ranges, true);
+    for (const Candidate& c : candidates)
+    {
+        if (c.id == 0)
+        {
+            cout << "Deployed parameters:" << endl;
+            PrintCandidates(cout, vector<Candidate>(1, c), ranges, false);
+        }
+    }
+    if (!csv_path.empty())
+    {
+        ofstream csv(csv_path);
+        csv << "id";
+        for (int d = 0; d < kDimensions; d++) {csv << "," << ranges[d].name;}
+        csv << ",episodes,success_rate,collision_rate,success_steps,total_acceleration,front" << endl;
+        evaluated.insert(evaluated.end(), candidates.begin(), candidates.end());
+        for (const Candidate& c : evaluated)
+        {
+            csv << c.id;
+            for (int d = 0; d < kDimensions; d++) {csv << "," << c.values[d];}
+            csv << "," << c.totals.episodes << "," << SuccessRate(c.totals) << "," << CollisionRate(c.totals) << ","
+                << SuccessSteps(c.totals) << "," << MeanAcceleration(c.totals) << "," << c.front << endl;
+        }
+    }
+
+    google::protobuf::ShutdownProtobufLibrary();
+    return 0;
+}
@@ -0,0 +1,231 @@
+#ifndef VEHICLE_TRACKER_H
+#define VEHICLE_TRACKER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "custom_messages.pb.h"
+
+/**
+ * Tracks the other cars across world states by vehicle_id, so their accelerations can be
+ * estimated from the velocities they had on the last states. Every tracked car keeps the last
+ * kHistory samples in a ring buffer, and its acceleration is the velocity difference over the
+ * last window samples divided by their time span, so a detection costs O(1) however long the
+ * car has been tracked. The cars live in a dense array, found through a flat open-addressed
+ * table from vehicle_id to array index (linear probing, backward-shift deletion). A car that
+ * is missing from expire_after consecutive world states has left the field of view and is
+ * dropped. The table and the array only grow with the number of cars seen at once, so an
+ * update does not allocate once they reached their size.
+ */
+
+// One detection of a tracked car
+struct TrackedSample
+{
+    double t;                                       // Time of the world state in seconds
+    double x, y;
+    double vx, vy;
+};
+
+class VehicleTracker {
+
+public:
+    static const int kHistory = 8;                  // Samples kept per car
+
+    // A car and its recent samples
+    struct Track
+    {
+        int32_t vehicle_id;
+        int32_t lane_id;
+        uint64_t last_update;                       // Number of the last world state the car was detected in
+        int head;                                   // Ring index of the newest sample
+        int count;                                  // Valid samples, at most kHistory
+        TrackedSample history[kHistory];
+        double ax, ay;                              // Estimated acceleration, 0 until there are two samples
+
+        const TrackedSample& Newest() const { return this->history[this->head]; }
+        // The sample age updates before the newest one, age < count
+        const TrackedSample& Sample(int age) const { return this->history[(this->head - age + kHistory) % kHistory]; }
+    };
+
+    /* Constructor
+    *  \param[in]: dt Time step assumed between world states without a newer time stamp
+    *  \param[in]: window Samples the acceleration is estimated over, between 2 and kHistory
+    *  \param[in]: expire_after Number of world states a car can be missing before it is dropped
+    *  \param[in]: capacity Cars the tracker holds without growing
+     */
+    explicit VehicleTracker(double dt = 0.1, int window = 4, int expire_after = 3, int capacity = 64)
+        : dt(dt), window(window < 2 ? 2 : (window > kHistory ? kHistory : window)), expire_after(expire_after)
+    {
+        Reserve(capacity);
+    }
+
+    // Forget all cars, when a new simulation round starts
+    void Clear()
+    {
+        std::fill(this->table.begin(), this->table.end(), Slot{0, -1});
+        this->tracks.clear();
+        this->updates = 0;
+        this->time = 0.0;
+    }
+
+    /* Add the detections of a world state and drop the cars that are gone.
+    *  \param[in]: msg The states of all other cars
+     */
+    void Update(const custom_messages::WorldState& msg)
+    {
+        // Take the time of the world state, unless it does not advance (states without time stamps)
+        const double stamp = msg.time().sec() + 1e-9 * msg.time().nsec();
+        this->time = (this->updates == 0 || stamp > this->time) ? stamp : this->time + this->dt;
+        this->updates += 1;
+        for (const auto& vehicle_msg : msg.vehicles())
+        {
+            Track& track = FindOrInsert(vehicle_msg.vehicle_id());
+            track.lane_id = vehicle_msg.lane_id();
+            track.last_update = this->updates;
+            track.head = (track.head + 1) % kHistory;
+            track.count += (track.count < kHistory) ? 1 : 0;
+            TrackedSample& sample = track.history[track.head];
+            sample.t = this->time;
+            sample.x = vehicle_msg.position().x();
+            sample.y = vehicle_msg.position().y();
+            sample.vx = vehicle_msg.velocity().x();
+            sample.vy = vehicle_msg.velocity().y();
+            Estimate(track);
+        }
+        // Drop the cars missing for too long, the last car of the array takes the place of a dropped one
+        for (size_t i = 0; i < this->tracks.size();)
+        {
+            if (this->updates - this->tracks[i].last_update < (uint64_t)this->expire_after) {i++; continue;}
+            Erase(this->tracks[i].vehicle_id);
+            if (i + 1 < this->tracks.size())
+            {
+                this->tracks[i] = this->tracks.back();
+                this->table[FindSlot(this->tracks[i].vehicle_id)].index = (int32_t)i;
+            }
+            this->tracks.pop_back();
+        }
+    }
+
+    /* Look up a tracked car.
+    *  \return: The track, null if the car is not tracked
+     */
+    const Track* Find(int32_t vehicle_id) const
+    {
+        const int32_t index = this->table[FindSlot(vehicle_id)].index;
+        return (index < 0) ? nullptr : &this->tracks[index];
+    }
+
+    // Estimated acceleration of a car, 0 if it is not tracked
+    void Acceleration(int32_t vehicle_id, double& ax, double& ay) const
+    {
+        const Track* track = Find(vehicle_id);
+        ax = track ? track->ax : 0.0;
+        ay = track ? track->ay : 0.0;
+    }
+
+    size_t Size() const { return this->tracks.size(); }
+    const std::vector<Track>& Tracks() const { return this->tracks; }
+
+private:
+    // A table entry, index is -1 for an empty entry
+    struct Slot
+    {
+        int32_t vehicle_id;
+        int32_t index;                              // Index of the car in tracks
+    };
+
+    // Velocity difference over the window, the older samples of a longer history are ignored
+    void Estimate(Track& track) const
+    {
+        const int span = ((track.count < this->window) ? track.count : this->window) - 1;
+        if (span <= 0) {track.ax = 0.0; track.ay = 0.0; return;}
+        const TrackedSample& newest = track.Newest();
+        const TrackedSample& oldest = track.Sample(span);
+        const double elapsed = newest.t - oldest.t;
+        if (elapsed <= 0.0) {return;}
+        track.ax = (newest.vx - oldest.vx) / elapsed;
+        track.ay = (newest.vy - oldest.vy) / elapsed;
+    }
+
+    // Table entry of the car, or the empty entry where it would be inserted
+    size_t FindSlot(int32_t vehicle_id) const
+    {
+        size_t slot = Hash(vehicle_id) & this->mask;
+        while (this->table[slot].index >= 0 && this->table[slot].vehicle_id != vehicle_id) {slot = (slot + 1) & this->mask;}
+        return slot;
+    }
+
+    Track& FindOrInsert(int32_t vehicle_id)
+    {
+        size_t slot = FindSlot(vehicle_id);
+        if (this->table[slot].index >= 0) {return this->tracks[this->table[slot].index];}
+        // Keep the table at most half full, so the probe sequences stay short
+        if (2 * (this->tracks.size() + 1) > this->table.size())
+        {
+            Reserve(2 * this->tracks.size() + 2);
+            slot = FindSlot(vehicle_id);
+        }
+        this->table[slot].vehicle_id = vehicle_id;
+        this->table[slot].index = (int32_t)this->tracks.size();
+        Track track = {};
+        track.vehicle_id = vehicle_id;
+        track.head = kHistory - 1;
+        this->tracks.push_back(track);
+        return this->tracks.back();
+    }
+
+    // Remove a car from the table, the entries after it move back to close the gap of its probe sequence
+    void Erase(int32_t vehicle_id)
+    {
+        size_t hole = FindSlot(vehicle_id);
+        if (this->table[hole].index < 0) {return;}
+        size_t slot = hole;
+        while (true)
+        {
+            slot = (slot + 1) & this->mask;
+            if (this->table[slot].index < 0) {break;}
+            const size_t home = Hash(this->table[slot].vehicle_id) & this->mask;
+            // Move the entry unless its home lies cyclically in (hole, slot]
+            if (((slot - home) & this->mask) >= ((slot - hole) & this->mask))
+            {
+                this->table[hole] = this->table[slot];
+                hole = slot;
+            }
+        }
+        this->table[hole].index = -1;
+    }
+
+    // Size the table for capacity cars and insert the tracked cars again
+    void Reserve(size_t capacity)
+    {
+        size_t size = 16;
+        while (size < 2 * capacity) {size *= 2;}
+        if (size <= this->table.size()) {return;}
+        this->table.assign(size, Slot{0, -1});
+        this->mask = size - 1;
+        this->tracks.reserve(capacity);
+        for (size_t i = 0; i < this->tracks.size(); i++)
+        {
+            const size_t slot = FindSlot(this->tracks[i].vehicle_id);
+            this->table[slot].vehicle_id = this->tracks[i].vehicle_id;
+            this->table[slot].index = (int32_t)i;
+        }
+    }
+
+    static size_t Hash(int32_t vehicle_id)
+    {
+        // Fibonacci hashing spreads consecutive ids over the table
+        return (size_t)(((uint64_t)(uint32_t)vehicle_id * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    const double dt;
+    const int window;
+    const int expire_after;
+    std::vector<Slot> table;                        // Open-addressed table from vehicle_id to index in tracks
+    size_t mask = 0;                                // Table size - 1, the size is a power of two
+    std::vector<Track> tracks;                      // The tracked cars, dense
+    uint64_t updates = 0;                           // Number of world states seen since the last Clear
+    double time = 0.0;                              // Time of the last world state
+};
+
+#endif // VEHICLE_TRACKER_H
@@ -0,0 +1,284 @@
+#ifndef WORLD_SIM_H
+#define WORLD_SIM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "custom_messages.pb.h"
+
+/**
+ * In-process stand-in for the Gazebo world plugin (world/libworld_sim.so).
+ * It follows the rules from the README: the simulation runs at 10Hz, the ego car starts on
+ * lane 0 with a velocity in [5 m/s, 15 m/s], other cars come from lanes 1-3 and drive straight,
+ * the episode succeeds when the ego car reaches (30, 2), and the speed, acceleration and jerk
+ * limits are checked on every step. It produces the same WorldState and Statistics messages
+ * as the simulator and consumes the same Command message, so a planner can be run on it
+ * without any transport.
+ */
+
+// Parameters of the generated scenarios
+struct SimConfig
+{
+    double dt = 0.1;                                // Time step in seconds
+    int max_steps = 400;                            // Time out of an episode in steps
+    int min_vehicles = 1, max_vehicles = 6;         // Number of other cars at the start of an episode
+    int lane_mask = 0xE;                            // Bit i set means other cars can show up on lane i (1-3)
+    double arrival_rate = 0.02;                     // Probability per lane and step that a new car enters the road
+    double road_length = 50.0;                      // Length of each road from the centre of the intersection
+    double lane_offset = 2.0;                       // Lateral offset of a lane from the road axis
+    double min_ego_pos = -50.0, max_ego_pos = -10.0; // Start position of the ego car on lane 0
+    double min_ego_vel = 5.0, max_ego_vel = 15.0;   // Start velocity of the ego car
+    double min_car_vel = 3.0, max_car_vel = 15.0;   // Desired velocity of other cars
+    double min_car_start = -20.0;                   // Other cars start between -road_length and this distance to the centre
+    double goal_x = 30.0;                           // The ego car succeeds when it reaches (goal_x, lane_offset)
+    double max_v = 20.0, max_a = 2.0, max_jerk = 0.2; // Limits of the ego car
+    double car_length = 4.5, car_width = 2.0;       // Footprint used for collision detection
+    double min_gap = 8.0;                           // Distance other cars keep to the car in front of them
+};
+
+class WorldSim {
+
+public:
+    /* Constructor, generate a random scenario
+    *  \param[in]: config The scenario parameters
+    *  \param[in]: seed The seed of the scenario, the same seed always gives the same episode
+    *  \param[in]: simulation_round The round number sent in the world state messages
+     */
+    WorldSim(const SimConfig& config, uint64_t seed, int32_t simulation_round)
+        : config(config), rng(seed), simulation_round(simulation_round)
+    {
+        this->ego_pos = Uniform(config.min_ego_pos, config.max_ego_pos);
+        this->ego_vel = Uniform(config.min_ego_vel, config.max_ego_vel);
+        int num_vehicles = config.min_vehicles + (int)(this->rng() % (uint64_t)(config.max_vehicles - config.min_vehicles + 1));
+        for (int i = 0; i < num_vehicles; i++)
+        {
+            SpawnVehicle(Uniform(-config.road_length, config.min_car_start));
+        }
+        this->statistics.set_total_acceleration(0.0);
+        this->statistics.set_simulation_time_steps_taken(0);
+        this->statistics.set_success(false);
+        this->statistics.set_collision_detected(false);
+        this->statistics.set_limits_respected(true);
+        FillWorldState();
+    }
+
+    // The world state of the current time step
+    const custom_messages::WorldState& State() const { return this->world_state; }
+
+    // The statistics of the episode, complete once Done() is true
+    const custom_messages::Statistics& Stats() const { return this->statistics; }
+
+    // True once the ego car reached the goal, collided or ran out of time
+    bool Done() const { return this->done; }
+
+    /* Advance the world by one time step with the command of the planner.
+    *  Commands of another simulation round are ignored, like the simulator does.
+    *  \param[in]: command The velocity of the ego car for the next time step
+     */
+    void Step(const custom_messages::Command& command)
+    {
+        if (this->done || command.simulation_round() != this->simulation_round)
+        {
+            return;
+        }
+        // Move the ego car and check its limits
+        double vel = command.ego_car_speed();
+        double acc = (vel - this->ego_vel) / this->config.dt;
+        const double eps = 1e-6;
+        if (vel < -eps || vel > this->config.max_v + eps || std::abs(acc) > this->config.max_a + eps ||
+            std::abs(acc - this->ego_acc) > this->config.max_jerk + eps)
+        {
+            this->statistics.set_limits_respected(false);
+        }
+        this->statistics.set_total_acceleration(this->statistics.total_acceleration() + std::abs(acc));
+        this->ego_pos += vel * this->config.dt;
+        this->ego_vel = vel;
+        this->ego_acc = acc;
+
+        MoveVehicles();
+        this->steps += 1;
+        this->statistics.set_simulation_time_steps_taken(this->steps);
+
+        if (Collides())
+        {
+            this->statistics.set_collision_detected(true);
+            this->done = true;
+        }
+        else if (this->ego_pos >= this->config.goal_x)
+        {
+            this->statistics.set_success(true);
+            this->done = true;
+        }
+        else if (this->steps >= this->config.max_steps)
+        {
+            this->done = true;
+        }
+        FillWorldState();
+    }
+
+private:
+    // A car on one of the other incoming roads, s is its signed distance to the centre along its lane
+    struct SimVehicle
+    {
+        int32_t id;
+        int32_t lane;
+        double s;
+        double v;
+        double v_desired;
+    };
+
+    double Uniform(double lo, double hi)
+    {
+        return std::uniform_real_distribution<double>(lo, hi)(this->rng);
+    }
+
+    // Put a new car at distance s on a random enabled lane if there is enough space for it
+    void SpawnVehicle(double s)
+    {
+        int lanes[3];
+        int num_lanes = 0;
+        for (int lane = 1; lane <= 3; lane++)
+        {
+            if (this->config.lane_mask & (1 << lane)) {lanes[num_lanes++] = lane;}
+        }
+        if (num_lanes == 0) {return;}
+        SpawnVehicleOnLane(lanes[this->rng() % num_lanes], s);
+    }
+
+    void SpawnVehicleOnLane(int lane, double s)
+    {
+        for (const SimVehicle& vehicle : this->vehicles)
+        {
+            if (vehicle.lane == lane && std::abs(vehicle.s - s) < this->config.min_gap) {return;}
+        }
+        double v = Uniform(this->config.min_car_vel, this->config.max_car_vel);
+        this->vehicles.push_back(SimVehicle{this->next_id++, lane, s, v, v});
+    }
+
+    /* Move other cars along their lanes. They drive towards their desired velocity and keep
+    *  min_gap to the car in front of them. Cars on lane 1 have the right of way and do not react
+    *  to the ego car, cars on lane 3 yield to it and wait at the intersection until it has passed.
+     */
+    void MoveVehicles()
+    {
+        const double dt = this->config.dt;
+        const double stop_line = -(this->config.lane_offset + this->config.car_length);
+        const bool ego_crossing = this->ego_pos < this->config.lane_offset + this->config.car_length;
+        for (SimVehicle& vehicle : this->vehicles)
+        {
+            double gap = 1e9;
+            if (vehicle.lane == 3 && ego_crossing && vehicle.s < stop_line)
+            {
+                gap = stop_line - vehicle.s + this->config.min_gap;
+            }
+            for (const SimVehicle& other : this->vehicles)
+            {
+                if (&other != &vehicle && other.lane == vehicle.lane && other.s > vehicle.s)
+                {
+                    gap = std::min(gap, other.s - vehicle.s);
+                }
+            }
+            double v_safe = std::max(0.0, (gap - this->config.min_gap) / 1.0);
+            double v_next = std::min(vehicle.v_desired, v_safe);
+            v_next = std::max(vehicle.v - 8.0 * dt, std::min(vehicle.v + 2.0 * dt, v_next));
+            vehicle.v = std::max(0.0, v_next);
+        }
+        for (SimVehicle& vehicle : this->vehicles)
+        {
+            vehicle.s += vehicle.v * dt;
+        }
+        // Remove cars that left the map and let new cars enter
+        const double road_length = this->config.road_length;
+        this->vehicles.erase(std::remove_if(this->vehicles.begin(), this->vehicles.end(),
+            [road_length](const SimVehicle& vehicle) {return vehicle.s > road_length;}), this->vehicles.end());
+        for (int lane = 1; lane <= 3; lane++)
+        {
+            if ((this->config.lane_mask & (1 << lane)) && Uniform(0.0, 1.0) < this->config.arrival_rate)
+            {
+                SpawnVehicleOnLane(lane, -road_length);
+            }
+        }
+    }
+
+    /* Map a car to the world frame. Lanes are numbered counter-clockwise, lane 0 is the road
+    *  of the ego car coming from -x, lane 1 comes from -y, lane 2 from +x and lane 3 from +y.
+     */
+    void ToWorld(const SimVehicle& vehicle, double& x, double& y, double& vx, double& vy) const
+    {
+        const double offset = this->config.lane_offset;
+        switch (vehicle.lane)
+        {
+            case 1: x = -offset; y = vehicle.s; vx = 0.0; vy = vehicle.v; break;
+            case 2: x = -vehicle.s; y = -offset; vx = -vehicle.v; vy = 0.0; break;
+            default: x = offset; y = -vehicle.s; vx = 0.0; vy = -vehicle.v; break;
+        }
+    }
+
+    // Check the footprint of the ego car against the footprints of all other cars
+    bool Collides() const
+    {
+        const double half_length = 0.5 * this->config.car_length, half_width = 0.5 * this->config.car_width;
+        for (const SimVehicle& vehicle : this->vehicles)
+        {
+            double x, y, vx, vy;
+            ToWorld(vehicle, x, y, vx, vy);
+            bool along_x = (vehicle.lane == 2);
+            double reach_x = half_length + (along_x ? half_length : half_width);
+            double reach_y = half_width + (along_x ? half_width : half_length);
+            if (std::abs(x - this->ego_pos) < reach_x && std::abs(y - this->config.lane_offset) < reach_y)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Write the current state into the world state message, only cars on the map are detected
+    void FillWorldState()
+    {
+        custom_messages::WorldState& msg = this->world_state;
+        int64_t nsec = (int64_t)this->steps * (int64_t)std::llround(this->config.dt * 1e9);
+        msg.mutable_time()->set_sec((int32_t)(nsec / 1000000000));
+        msg.mutable_time()->set_nsec((int32_t)(nsec % 1000000000));
+        msg.set_simulation_round(this->simulation_round);
+        custom_messages::VehicleState* ego = msg.mutable_ego_vehicle();
+        ego->set_vehicle_id(0);
+        ego->set_lane_id(0);
+        ego->mutable_position()->set_x(this->ego_pos);
+        ego->mutable_position()->set_y(this->config.lane_offset);
+        ego->mutable_velocity()->set_x(this->ego_vel);
+        ego->mutable_velocity()->set_y(0.0);
+        msg.clear_vehicles();
+        for (const SimVehicle& vehicle : this->vehicles)
+        {
+            if (vehicle.s < -this->config.road_length) {continue;}
+            double x, y, vx, vy;
+            ToWorld(vehicle, x, y, vx, vy);
+            custom_messages::VehicleState* vehicle_msg = msg.add_vehicles();
+            vehicle_msg->set_vehicle_id(vehicle.id);
+            vehicle_msg->set_lane_id(vehicle.lane);
+            vehicle_msg->mutable_position()->set_x(x);
+            vehicle_msg->mutable_position()->set_y(y);
+            vehicle_msg->mutable_velocity()->set_x(vx);
+            vehicle_msg->mutable_velocity()->set_y(vy);
+        }
+    }
+
+private:
+    const SimConfig config;
+    std::mt19937_64 rng;                            // Random source of this episode
+    int32_t simulation_round;                       // Round number of this episode
+    double ego_pos;                                 // Position of the ego car on lane 0 (x axis)
+    double ego_vel;                                 // Velocity of the ego car
+    double ego_acc = 0.0;                           // Acceleration of the ego car in the last step
+    int32_t steps = 0;                              // Number of simulated steps
+    int32_t next_id = 1;                            // Id of the next spawned car, 0 is the ego car
+    bool done = false;                              // If the episode is over
+    std::vector<SimVehicle> vehicles;               // Other cars
+    custom_messages::WorldState world_state;        // Message of the current time step
+    custom_messages::Statistics statistics;         // Statistics of this episode
+};
+
+#endif // WORLD_SIM_H